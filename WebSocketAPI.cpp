@@ -30,6 +30,37 @@ Author:
 #include "jwt.h"
 //----------------------------------------------------------------------------------------------------------------------
 
+#include <atomic>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+//----------------------------------------------------------------------------------------------------------------------
+
+#define WS_OPCODE_TEXT 0x01
+#define WS_OPCODE_BINARY 0x02
+#define WS_PROTOCOL_DEFLATE "json.deflate"
+#define WS_PROTOCOL_MSGPACK "msgpack"
+#define WS_PROTOCOL_MSGPACK_DEFLATE "msgpack.deflate"
+
+#define WS_TOO_MANY_REQUESTS static_cast<CHTTPReply::CStatusType> (429)
+
+#define WS_DIRECTORY_SESSION 48
+#define WS_DIRECTORY_IDENTITY 64
+#define WS_NOTIFY_PAYLOAD_MAX 7999
+#define WS_NOTIFY_CHANNEL_MAX 63
+#define WS_NOTIFY_READERS 256
+
+#define WS_OID_JSON 114
+#define WS_OID_JSONB 3802
+
+//----------------------------------------------------------------------------------------------------------------------
+
 extern "C++" {
 
 namespace Apostol {
@@ -38,395 +69,3854 @@ namespace Apostol {
 
         //--------------------------------------------------------------------------------------------------------------
 
-        //-- CWebSocketAPI ---------------------------------------------------------------------------------------------
+        //-- CObserverFilter -------------------------------------------------------------------------------------------
 
         //--------------------------------------------------------------------------------------------------------------
 
-        CWebSocketAPI::CWebSocketAPI(CModuleProcess *AProcess) : CApostolModule(AProcess, "web socket api") {
-            m_Headers.Add("Authorization");
-            m_Headers.Add("Session");
-            m_Headers.Add("Secret");
+        // Filter field (plural, as in the listener filter) and the NOTIFY payload key it is matched against.
+        static const char *FilterFields[CObserverFilter::FieldCount][2] = {
+            {"entities", "entity"},
+            {"classes", "class"},
+            {"actions", "action"},
+            {"methods", "method"},
+            {"objects", "object"},
+            {"types", "type"},
+            {"codes", "code"},
+            {"categories", "category"},
+            {"agents", "agent"},
+            {"profiles", "profile"},
+            {"addresses", "address"},
+            {"subjects", "subject"}
+        };
+        //--------------------------------------------------------------------------------------------------------------
 
-            m_CheckDate = 0;
+        void CObserverFilter::Parse(const CString &Data, CObserverFilter::CEvent &Event) {
+            Event.Fields = 0;
 
-            CWebSocketAPI::InitMethods();
+            try {
+                const CJSON Json(Data);
+
+                for (int i = 0; i < FieldCount; ++i) {
+                    const CString caKey(FilterFields[i][1]);
+                    const CString caCode(caKey + "code");
+
+                    // Filters hold codes, so prefer "<key>code" over the numeric identifier when both are present.
+                    const auto& caName = Json.HasOwnProperty(caCode) ? caCode : caKey;
+
+                    if (Json.HasOwnProperty(caName) && !Json[caName].IsNull()) {
+                        Event.Values[i] = Json[caName].AsString().c_str();
+                        Event.Fields |= 1u << i;
+                    }
+                }
+            } catch (...) {
+                Event.Fields = 0;
+            }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CWebSocketAPI::InitMethods() {
-#if defined(_GLIBCXX_RELEASE) && (_GLIBCXX_RELEASE >= 9)
-            m_pMethods->AddObject(_T("GET")    , (CObject *) new CMethodHandler(true , [this](auto && Connection) { DoGet(Connection); }));
-            m_pMethods->AddObject(_T("POST")   , (CObject *) new CMethodHandler(true , [this](auto && Connection) { DoPost(Connection); }));
-            m_pMethods->AddObject(_T("OPTIONS"), (CObject *) new CMethodHandler(true , [this](auto && Connection) { DoOptions(Connection); }));
-            m_pMethods->AddObject(_T("HEAD")   , (CObject *) new CMethodHandler(false, [this](auto && Connection) { MethodNotAllowed(Connection); }));
-            m_pMethods->AddObject(_T("PUT")    , (CObject *) new CMethodHandler(false, [this](auto && Connection) { MethodNotAllowed(Connection); }));
-            m_pMethods->AddObject(_T("DELETE") , (CObject *) new CMethodHandler(false, [this](auto && Connection) { MethodNotAllowed(Connection); }));
-            m_pMethods->AddObject(_T("TRACE")  , (CObject *) new CMethodHandler(false, [this](auto && Connection) { MethodNotAllowed(Connection); }));
-            m_pMethods->AddObject(_T("PATCH")  , (CObject *) new CMethodHandler(false, [this](auto && Connection) { MethodNotAllowed(Connection); }));
-            m_pMethods->AddObject(_T("CONNECT"), (CObject *) new CMethodHandler(false, [this](auto && Connection) { MethodNotAllowed(Connection); }));
-#else
-            m_pMethods->AddObject(_T("GET")    , (CObject *) new CMethodHandler(true , std::bind(&CWebSocketAPI::DoGet, this, _1)));
-            m_pMethods->AddObject(_T("POST")   , (CObject *) new CMethodHandler(true , std::bind(&CWebSocketAPI::DoPost, this, _1)));
-            m_pMethods->AddObject(_T("OPTIONS"), (CObject *) new CMethodHandler(true , std::bind(&CWebSocketAPI::DoOptions, this, _1)));
-            m_pMethods->AddObject(_T("HEAD")   , (CObject *) new CMethodHandler(false, std::bind(&CWebSocketAPI::MethodNotAllowed, this, _1)));
-            m_pMethods->AddObject(_T("PUT")    , (CObject *) new CMethodHandler(false, std::bind(&CWebSocketAPI::MethodNotAllowed, this, _1)));
-            m_pMethods->AddObject(_T("DELETE") , (CObject *) new CMethodHandler(false, std::bind(&CWebSocketAPI::MethodNotAllowed, this, _1)));
-            m_pMethods->AddObject(_T("TRACE")  , (CObject *) new CMethodHandler(false, std::bind(&CWebSocketAPI::MethodNotAllowed, this, _1)));
-            m_pMethods->AddObject(_T("PATCH")  , (CObject *) new CMethodHandler(false, std::bind(&CWebSocketAPI::MethodNotAllowed, this, _1)));
-            m_pMethods->AddObject(_T("CONNECT"), (CObject *) new CMethodHandler(false, std::bind(&CWebSocketAPI::MethodNotAllowed, this, _1)));
-#endif
+        void CObserverFilter::Compile(const CJSON &Filter) {
+            Invalidate();
+
+            if (Filter.IsNull()) {
+                m_Valid = true;
+                return;
+            }
+
+            if (!Filter.IsObject())
+                return;
+
+            int Count = 0;
+
+            for (int i = 0; i < FieldCount; ++i) {
+                const CString caName(FilterFields[i][0]);
+
+                if (!Filter.HasOwnProperty(caName))
+                    continue;
+
+                Count++;
+
+                const auto& caValues = Filter[caName];
+
+                if (caValues.IsNull())
+                    continue;
+
+                if (!caValues.IsArray())
+                    return;
+
+                for (int j = 0; j < caValues.Count(); ++j)
+                    m_Values[i].emplace(caValues[j].AsString().c_str());
+
+                if (!m_Values[i].empty())
+                    m_Fields |= 1u << i;
+            }
+
+            // A field we do not know how to match has to be left to the database.
+            m_Valid = Count == Filter.Count();
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        int CWebSocketAPI::CheckError(const CJSON &Json, CString &ErrorMessage, bool RaiseIfError) {
-            int errorCode = 0;
+        void CObserverFilter::Invalidate() {
+            m_Valid = false;
+            m_Fields = 0;
+            for (auto &values : m_Values)
+                values.clear();
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            if (Json.HasOwnProperty(_T("error"))) {
-                const auto& error = Json[_T("error")];
+        CFilterMatch CObserverFilter::Match(const CObserverFilter::CEvent &Event) const {
+            if (!m_Valid)
+                return fmMaybe;
 
-                if (error.HasOwnProperty(_T("code"))) {
-                    errorCode = error[_T("code")].AsInteger();
-                } else {
-                    errorCode = 40000;
-                }
+            CFilterMatch Result = fmYes;
 
-                if (error.HasOwnProperty(_T("message"))) {
-                    ErrorMessage = error[_T("message")].AsString();
-                } else {
-                    ErrorMessage = _T("Invalid request.");
+            for (int i = 0; i < FieldCount; ++i) {
+                const uint32_t Bit = 1u << i;
+
+                if ((m_Fields & Bit) == 0)
+                    continue;
+
+                if ((Event.Fields & Bit) == 0) {
+                    Result = fmMaybe;
+                } else if (m_Values[i].count(Event.Values[i]) == 0) {
+                    return fmNo;
                 }
+            }
 
-                if (RaiseIfError)
-                    throw EDBError(ErrorMessage.c_str());
+            return Result;
+        }
 
-                if (errorCode >= 10000)
-                    errorCode = errorCode / 100;
+        //--------------------------------------------------------------------------------------------------------------
 
-                if (errorCode < 0)
-                    errorCode = 400;
-            }
+        //-- CObserverIndex --------------------------------------------------------------------------------------------
 
-            return errorCode;
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CObserverIndex::Known(const CString &Session) const {
+            const auto it = m_Listeners.find(Session.c_str());
+            return it != m_Listeners.end() && it->second.Known && std::chrono::steady_clock::now() < it->second.Expires;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        CHTTPReply::CStatusType CWebSocketAPI::ErrorCodeToStatus(int ErrorCode) {
-            CHTTPReply::CStatusType Status = CHTTPReply::ok;
+        unsigned CObserverIndex::Revision(const CString &Session) const {
+            const auto it = m_Listeners.find(Session.c_str());
+            return it == m_Listeners.end() ? 0 : it->second.Revision;
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            if (ErrorCode != 0) {
-                switch (ErrorCode) {
-                    case 401:
-                        Status = CHTTPReply::unauthorized;
-                        break;
+        bool CObserverIndex::Request(const CString &Session) {
+            const auto now = std::chrono::steady_clock::now();
 
-                    case 403:
-                        Status = CHTTPReply::forbidden;
-                        break;
+            // One discovery per session and TTL, a failed one is retried after that.
+            auto &listeners = m_Listeners[Session.c_str()];
+            if (listeners.Requested != std::chrono::steady_clock::time_point() && now < listeners.Requested + m_TTL)
+                return false;
 
-                    case 404:
-                        Status = CHTTPReply::not_found;
-                        break;
+            listeners.Requested = now;
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-                    case 500:
-                        Status = CHTTPReply::internal_server_error;
-                        break;
+        CObserverMatch CObserverIndex::Match(const CString &Session, const CString &Publisher,
+                const CObserverFilter::CEvent &Event) const {
 
-                    default:
-                        Status = CHTTPReply::bad_request;
-                        break;
-                }
+            // Listeners may also be changed by other workers, the REST API or the database itself, so unless pruning is
+            // enabled the database decides about everything that is not delivered locally.
+            if (!Known(Session))
+                return omQuery;
+
+            const auto &listeners = m_Listeners.find(Session.c_str())->second;
+
+            const auto listener = listeners.Publishers.find(Publisher.c_str());
+            if (listener == listeners.Publishers.end())
+                return m_Prune ? omSkip : omQuery;
+
+            switch (listener->second.Filter.Match(Event)) {
+                case fmNo:
+                    return m_Prune ? omSkip : omQuery;
+                case fmYes:
+                    return listener->second.Notify ? omDeliver : omQuery;
+                default:
+                    return omQuery;
             }
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            return Status;
+        void CObserverIndex::Subscribe(const CString &Session, const CString &Publisher) {
+            auto &listeners = m_Listeners[Session.c_str()];
+            listeners.Revision++;
+            listeners.Publishers[Publisher.c_str()].Filter.Invalidate();
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CWebSocketAPI::AfterQuery(CHTTPServerConnection *AConnection, const CString &Path, const CJSON &Payload) {
+        void CObserverIndex::Subscribe(const CString &Session, const CString &Publisher, const CJSON &Listener) {
+            auto &listeners = m_Listeners[Session.c_str()];
+            listeners.Revision++;
 
-            auto pSession = CSession::FindOfConnection(AConnection);
+            auto &listener = listeners.Publishers[Publisher.c_str()];
 
-            auto SignIn = [pSession](const CJSON &Payload) {
+            if (Listener.HasOwnProperty(_T("filter"))) {
+                listener.Filter.Compile(Listener[_T("filter")]);
+            } else {
+                listener.Filter.Compile(CJSON());
+            }
 
-                const auto& session = Payload[_T("session")].AsString();
-                const auto& secret = Payload[_T("secret")].AsString();
+            listener.Notify = true;
+            if (Listener.HasOwnProperty(_T("params"))) {
+                const auto& caParams = Listener[_T("params")];
+                if (caParams.IsObject() && caParams.HasOwnProperty(_T("type")))
+                    listener.Notify = caParams[_T("type")].AsString() == _T("notify");
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-                pSession->Session() = session;
-                pSession->Secret() = secret;
+        void CObserverIndex::Unsubscribe(const CString &Session, const CString &Publisher) {
+            const auto it = m_Listeners.find(Session.c_str());
+            if (it != m_Listeners.end()) {
+                it->second.Revision++;
+                it->second.Publishers.erase(Publisher.c_str());
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-                pSession->Authorized(true);
-            };
+        void CObserverIndex::Discovered(const CString &Session) {
+            auto &listeners = m_Listeners[Session.c_str()];
+            listeners.Known = true;
+            listeners.Expires = std::chrono::steady_clock::now() + m_TTL;
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            auto SignOut = [pSession](const CJSON &Payload) {
-                pSession->Secret().Clear();
-                pSession->Authorization().Clear();
-                pSession->Authorized(false);
-            };
+        void CObserverIndex::Forget(const CString &Session) {
+            auto &listeners = m_Listeners[Session.c_str()];
+            listeners.Known = false;
+            listeners.Revision++;
+            listeners.Requested = std::chrono::steady_clock::time_point();
+            listeners.Publishers.clear();
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            auto Authorize = [pSession](const CJSON &Payload) {
+        void CObserverIndex::Delete(const CString &Session) {
+            m_Listeners.erase(Session.c_str());
+        }
 
-                if (Payload.HasOwnProperty(_T("authorized"))) {
-                    pSession->Authorized(Payload[_T("authorized")].AsBoolean());
-                }
+        //--------------------------------------------------------------------------------------------------------------
 
-                if (!pSession->Authorized()) {
-                    pSession->Secret().Clear();
-                    pSession->Authorization().Clear();
+        //-- CSharedMemory ---------------------------------------------------------------------------------------------
 
-                    const auto& message = Payload[_T("message")].AsString();
-                    throw Delphi::Exception::Exception(message.IsEmpty() ? _T("Unknown error.") : message.c_str());
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CSharedMemory::CHeader {
+            pthread_mutex_t Mutex;
+            std::atomic<uint32_t> Ready;
+            uint32_t Attached;
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        void *CSharedMemory::Map(const std::string &Name, size_t Length) {
+            Unmap();
+
+            // Exactly one worker creates the segment and sets it up, the others wait until it is ready.
+            auto Fd = shm_open(Name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+            const auto bCreated = Fd != -1;
+
+            if (!bCreated && errno == EEXIST)
+                Fd = shm_open(Name.c_str(), O_RDWR, 0600);
+
+            if (Fd == -1)
+                return nullptr;
+
+            auto Size = sizeof(CHeader) + Length;
+
+            if (bCreated) {
+                if (ftruncate(Fd, (off_t) Size) == -1) {
+                    close(Fd);
+                    shm_unlink(Name.c_str());
+                    return nullptr;
                 }
-            };
+            } else {
+                // Created by another worker first: its size wins.
+                struct stat st = {};
+                for (int i = 0; i < 1000 && fstat(Fd, &st) == 0 && st.st_size == 0; ++i)
+                    sched_yield();
+                Size = (size_t) st.st_size;
+            }
 
-            if (Path == _T("/api/v1/sign/in")) {
-                SignIn(Payload);
-            } else if (Path == _T("/api/v1/sign/out")) {
-                SignOut(Payload);
-            } else if (Path == _T("/api/v1/authenticate")) {
-                Authorize(Payload);
-            } else if (Path == _T("/api/v1/authorize")) {
-                Authorize(Payload);
+            auto pMap = Size <= sizeof(CHeader) ? MAP_FAILED : mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+            close(Fd);
+
+            if (pMap == MAP_FAILED)
+                return nullptr;
+
+            auto pHeader = static_cast<CHeader *> (pMap);
+
+            if (bCreated) {
+                pthread_mutexattr_t Attr;
+
+                pthread_mutexattr_init(&Attr);
+                pthread_mutexattr_setpshared(&Attr, PTHREAD_PROCESS_SHARED);
+                pthread_mutexattr_setrobust(&Attr, PTHREAD_MUTEX_ROBUST);
+                pthread_mutex_init(&pHeader->Mutex, &Attr);
+                pthread_mutexattr_destroy(&Attr);
+
+                Created(pHeader + 1);
+
+                pHeader->Ready.store(1, std::memory_order_release);
+            } else {
+                for (int i = 0; i < 1000 && pHeader->Ready.load(std::memory_order_acquire) == 0; ++i)
+                    sched_yield();
+
+                if (pHeader->Ready.load(std::memory_order_acquire) == 0) {
+                    munmap(pMap, Size);
+                    return nullptr;
+                }
             }
+
+            m_Header = pHeader;
+            m_Length = Size - sizeof(CHeader);
+            m_Name = Name;
+            m_Pid = getpid();
+
+            Lock();
+            m_Header->Attached++;
+            Unlock();
+
+            return m_Header + 1;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CWebSocketAPI::DoPostgresNotify(CPQConnection *AConnection, PGnotify *ANotify) {
-#ifdef _DEBUG
-            const auto& Info = AConnection->ConnInfo();
+        void CSharedMemory::Unmap() {
+            if (m_Header == nullptr)
+                return;
 
-            DebugMessage("[NOTIFY] [%d] [postgresql://%s@%s:%s/%s] [PID: %d] [%s] %s\n",
-                AConnection->Socket(), Info["user"].c_str(), Info["host"].c_str(), Info["port"].c_str(), Info["dbname"].c_str(),
-                ANotify->be_pid, ANotify->relname, ANotify->extra);
-#endif
-            for (int i = 0; i < m_SessionManager.Count(); ++i)
-                Observer(m_SessionManager[i], ANotify->relname, ANotify->extra);
+            Lock();
+            const auto bLast = --m_Header->Attached == 0;
+            Unlock();
+
+            munmap(m_Header, sizeof(CHeader) + m_Length);
+
+            if (bLast)
+                shm_unlink(m_Name.c_str());
+
+            m_Header = nullptr;
+            m_Length = 0;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CWebSocketAPI::DoPostgresQueryExecuted(CPQPollQuery *APollQuery) {
+        void CSharedMemory::Lock() const {
+            // Held for a short scan or copy only. A worker that dies holding it does not block the others: slots are
+            // marked used only after they are filled, so the data stay usable and the mutex is made consistent again.
+            if (pthread_mutex_lock(&m_Header->Mutex) == EOWNERDEAD)
+                pthread_mutex_consistent(&m_Header->Mutex);
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            auto pResult = APollQuery->Results(0);
+        void CSharedMemory::Unlock() const {
+            pthread_mutex_unlock(&m_Header->Mutex);
+        }
 
-            if (pResult->ExecStatus() != PGRES_TUPLES_OK) {
-                QueryException(APollQuery, Delphi::Exception::EDBError(pResult->GetErrorMessage()));
-                return;
-            }
+        //--------------------------------------------------------------------------------------------------------------
 
-            auto pConnection = dynamic_cast<CHTTPServerConnection *> (APollQuery->Binding());
+        //-- CSessionDirectory -----------------------------------------------------------------------------------------
 
-            if (pConnection != nullptr && !pConnection->ClosedGracefully()) {
+        //--------------------------------------------------------------------------------------------------------------
 
-                auto pWSReply = pConnection->WSReply();
+        struct CSessionDirectory::CHeader {
+            uint32_t Used;
+            uint32_t Deleted;
+            char Key[65];
+        };
 
-                CWSMessage wsmResponse;
+        struct CSessionDirectory::CSlot {
+            enum { Empty = 0, Used, Deleted };
 
-                wsmResponse.MessageTypeId = mtCallResult;
-                wsmResponse.UniqueId = APollQuery->Data()[_T("UniqueId")];
-                wsmResponse.Action = APollQuery->Data()[_T("Action")];
+            uint32_t State;
+            pid_t Pid;
+            char Session[WS_DIRECTORY_SESSION];
+            char Identity[WS_DIRECTORY_IDENTITY];
+        };
+        //--------------------------------------------------------------------------------------------------------------
 
-                const auto bDataArray = wsmResponse.Action.Find(_T("/list")) != CString::npos;
+        bool CSessionDirectory::Open(size_t Size) {
+            Close();
 
-                CHTTPReply::CStatusType status = CHTTPReply::bad_request;
+            if (Size == 0)
+                return false;
 
-                try {
-                    CString jsonString;
-                    PQResultToJson(pResult, jsonString, bDataArray ? "array" : "object");
+            // Workers of one master share the table, a restarted master starts with a new one.
+            auto pData = Map("/apostol-ws-" + std::to_string(getppid()), sizeof(CHeader) + Size * sizeof(CSlot));
+            if (pData == nullptr)
+                return false;
 
-                    wsmResponse.Payload << jsonString;
+            m_Header = static_cast<CHeader *> (pData);
+            m_Slots = reinterpret_cast<CSlot *> (m_Header + 1);
+            m_Size = (Length() - sizeof(CHeader)) / sizeof(CSlot);
 
-                    if (pResult->nTuples() == 1) {
-                        wsmResponse.ErrorCode = CheckError(bDataArray ? wsmResponse.Payload[0] : wsmResponse.Payload, wsmResponse.ErrorMessage);
-                        if (wsmResponse.ErrorCode == 0) {
-                            status = CHTTPReply::unauthorized;
-                            AfterQuery(pConnection, wsmResponse.Action, wsmResponse.Payload);
-                        } else {
-                            wsmResponse.MessageTypeId = mtCallError;
-                        }
-                    }
-                } catch (Delphi::Exception::Exception &E) {
-                    wsmResponse.MessageTypeId = mtCallError;
-                    wsmResponse.ErrorCode = status;
-                    wsmResponse.ErrorMessage = E.what();
+            // At least an eighth of the slots stays empty, so that every probe sequence ends early.
+            m_Limit = m_Size - std::max<size_t>(1, m_Size / 8);
 
-                    Log()->Error(APP_LOG_ERR, 0, "[WebSocketAPI] Error: %s", E.what());
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSessionDirectory::Created(void *AData) {
+            auto pHeader = static_cast<CHeader *> (AData);
+
+            // Key of the relay messages: only the workers that share the table can sign them.
+            unsigned char Random[32];
+            if (RAND_bytes(Random, sizeof(Random)) != 1) {
+                for (auto &ch : Random)
+                    ch = (unsigned char) random();
+            }
+
+            static const char Hex[] = "0123456789abcdef";
+
+            for (size_t i = 0; i < sizeof(Random); ++i) {
+                pHeader->Key[i * 2] = Hex[Random[i] >> 4];
+                pHeader->Key[i * 2 + 1] = Hex[Random[i] & 0x0F];
+            }
+
+            pHeader->Key[sizeof(Random) * 2] = '\0';
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSessionDirectory::Close() {
+            if (!Active())
+                return;
+
+            Lock();
+
+            for (size_t i = 0; i < m_Size; ++i) {
+                if (m_Slots[i].State == CSlot::Used && m_Slots[i].Pid == m_Pid)
+                    Release(m_Slots[i], i);
+            }
+
+            Unlock();
+            Unmap();
+
+            m_Header = nullptr;
+            m_Slots = nullptr;
+            m_Size = 0;
+            m_Limit = 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CSessionDirectory::Start(const CString &Session) const {
+            // All identities of a session share one probe sequence, so a lookup by session alone is a single walk.
+            uint64_t Hash = 14695981039346656037ULL;
+            for (size_t i = 0; i < Session.Size(); ++i) {
+                Hash ^= (unsigned char) Session.at(i);
+                Hash *= 1099511628211ULL;
+            }
+            return (size_t) (Hash % m_Size);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSessionDirectory::Release(CSlot &Slot, size_t Pos) const {
+            Slot.State = CSlot::Deleted;
+            m_Header->Used--;
+            m_Header->Deleted++;
+
+            // Tombstones at the end of a probe sequence are not needed, they would only lengthen later lookups.
+            if (m_Slots[(Pos + 1) % m_Size].State == CSlot::Empty) {
+                while (m_Slots[Pos].State == CSlot::Deleted) {
+                    m_Slots[Pos].State = CSlot::Empty;
+                    m_Header->Deleted--;
+                    Pos = (Pos + m_Size - 1) % m_Size;
                 }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSessionDirectory::Compact() {
+            // Tombstones have used up the empty slots: the live entries are inserted again into a clean table.
+            std::vector<CSlot> Slots;
+            Slots.reserve(m_Header->Used);
+
+            for (size_t i = 0; i < m_Size; ++i) {
+                if (m_Slots[i].State == CSlot::Used)
+                    Slots.push_back(m_Slots[i]);
+                m_Slots[i].State = CSlot::Empty;
+            }
+
+            for (const auto &slot : Slots) {
+                auto Pos = Start(slot.Session);
+                while (m_Slots[Pos].State != CSlot::Empty)
+                    Pos = (Pos + 1) % m_Size;
+                m_Slots[Pos] = slot;
+            }
+
+            m_Header->Used = (uint32_t) Slots.size();
+            m_Header->Deleted = 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSessionDirectory::Add(const CString &Session, const CString &Identity) {
+            if (!Active() || Session.Size() >= WS_DIRECTORY_SESSION || Identity.Size() >= WS_DIRECTORY_IDENTITY)
+                return;
+
+            Lock();
+
+            if (m_Header->Used + m_Header->Deleted >= m_Limit && m_Header->Deleted != 0)
+                Compact();
+
+            const auto Index = Start(Session);
+            CSlot *pFree = nullptr;
+
+            for (size_t i = 0; i < m_Size; ++i) {
+                auto &slot = m_Slots[(Index + i) % m_Size];
+
+                if (slot.State == CSlot::Empty) {
+                    // A new slot may only be taken while the table stays below its limit.
+                    if (pFree == nullptr && m_Header->Used + m_Header->Deleted < m_Limit)
+                        pFree = &slot;
+                    break;
+                }
+
+                if (slot.State == CSlot::Deleted) {
+                    if (pFree == nullptr)
+                        pFree = &slot;
+                    continue;
+                }
+
+                if (Session == slot.Session && Identity == slot.Identity) {
+                    // The session has moved to this worker.
+                    slot.Pid = m_Pid;
+                    Unlock();
+                    return;
+                }
+            }
+
+            if (pFree != nullptr) {
+                if (pFree->State == CSlot::Deleted)
+                    m_Header->Deleted--;
+
+                strcpy(pFree->Session, Session.c_str());
+                strcpy(pFree->Identity, Identity.c_str());
+                pFree->Pid = m_Pid;
+                pFree->State = CSlot::Used;
+
+                m_Header->Used++;
+            }
+
+            Unlock();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSessionDirectory::Remove(const CString &Session, const CString &Identity) {
+            if (!Active())
+                return;
+
+            Lock();
+
+            const auto Index = Start(Session);
+
+            for (size_t i = 0; i < m_Size; ++i) {
+                const auto Pos = (Index + i) % m_Size;
+                auto &slot = m_Slots[Pos];
+
+                if (slot.State == CSlot::Empty)
+                    break;
+
+                if (slot.State != CSlot::Used || slot.Pid != m_Pid || Session != slot.Session || Identity != slot.Identity)
+                    continue;
+
+                Release(slot, Pos);
+                break;
+            }
+
+            Unlock();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSessionDirectory::Find(const CString &Session, const CString &Identity, std::vector<pid_t> &Workers) const {
+            if (!Active())
+                return;
+
+            Lock();
+
+            const auto Index = Start(Session);
+
+            for (size_t i = 0; i < m_Size; ++i) {
+                auto &slot = m_Slots[(Index + i) % m_Size];
+
+                if (slot.State == CSlot::Empty)
+                    break;
+
+                if (slot.State != CSlot::Used || slot.Pid == m_Pid || Session != slot.Session)
+                    continue;
+
+                if (!Identity.IsEmpty() && Identity != slot.Identity)
+                    continue;
+
+                // Entries of a worker that died without closing the table.
+                if (kill(slot.Pid, 0) == -1 && errno == ESRCH) {
+                    Release(slot, (Index + i) % m_Size);
+                    continue;
+                }
+
+                if (std::find(Workers.begin(), Workers.end(), slot.Pid) == Workers.end())
+                    Workers.push_back(slot.Pid);
+            }
+
+            Unlock();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CSessionDirectory::Sign(const CString &Data) const {
+            return Active() ? hmac_sha256(CString(m_Header->Key), Data) : CString();
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CNotifyRing -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CNotifyRing::CHeader {
+            uint64_t Sequence;
+            pid_t Leader;
+            uint32_t Reserved;
+            pid_t Readers[WS_NOTIFY_READERS];
+        };
+
+        struct CNotifyRing::CSlot {
+            uint64_t Sequence;
+            pid_t Origin;
+            pid_t Target;
+            uint32_t Length;
+            char Channel[WS_NOTIFY_CHANNEL_MAX + 1];
+            char Payload[WS_NOTIFY_PAYLOAD_MAX + 1];
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CNotifyRing::Open(size_t Size) {
+            Close();
+
+            if (Size == 0)
+                return false;
+
+            auto pData = Map("/apostol-ws-notify-" + std::to_string(getppid()), sizeof(CHeader) + Size * sizeof(CSlot));
+            if (pData == nullptr)
+                return false;
+
+            m_Header = static_cast<CHeader *> (pData);
+            m_Slots = reinterpret_cast<CSlot *> (m_Header + 1);
+            m_Size = (Length() - sizeof(CHeader)) / sizeof(CSlot);
+
+            m_Wakeup = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+            if (m_Wakeup != -1) {
+                const auto &caName = WakeupName(m_Pid);
+
+                sockaddr_un Address = {};
+                Address.sun_family = AF_UNIX;
+                memcpy(Address.sun_path, caName.data(), caName.size());
+
+                if (bind(m_Wakeup, (sockaddr *) &Address, (socklen_t) (offsetof(sockaddr_un, sun_path) + caName.size())) == -1) {
+                    close(m_Wakeup);
+                    m_Wakeup = -1;
+                }
+            }
+
+            // Only messages published after attaching are read.
+            Lock();
+
+            m_Sequence = m_Header->Sequence;
+
+            if (m_Wakeup != -1) {
+                for (auto &reader : m_Header->Readers) {
+                    if (reader == 0 || reader == m_Pid || (kill(reader, 0) == -1 && errno == ESRCH)) {
+                        reader = m_Pid;
+                        break;
+                    }
+                }
+            }
+
+            Unlock();
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CNotifyRing::Close() {
+            if (!Active())
+                return;
+
+            Lock();
+
+            if (m_Header->Leader == m_Pid)
+                m_Header->Leader = 0;
+
+            for (auto &reader : m_Header->Readers) {
+                if (reader == m_Pid)
+                    reader = 0;
+            }
+
+            Unlock();
+
+            if (m_Wakeup != -1) {
+                close(m_Wakeup);
+                m_Wakeup = -1;
+            }
+
+            Unmap();
+
+            m_Header = nullptr;
+            m_Slots = nullptr;
+            m_Size = 0;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CNotifyRing::Leader() {
+            if (!Active())
+                return false;
+
+            Lock();
+
+            // The first worker to find the place vacant, or its owner gone, takes it.
+            if (m_Header->Leader == 0 || (m_Header->Leader != m_Pid && kill(m_Header->Leader, 0) == -1 && errno == ESRCH))
+                m_Header->Leader = m_Pid;
+
+            const auto bLeader = m_Header->Leader == m_Pid;
+
+            Unlock();
+
+            return bLeader;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CNotifyRing::Publish(const CString &Channel, const CString &Payload, pid_t Target) {
+            if (!Active() || Channel.Size() > WS_NOTIFY_CHANNEL_MAX || Payload.Size() > WS_NOTIFY_PAYLOAD_MAX)
+                return false;
+
+            Lock();
+
+            const auto Sequence = m_Header->Sequence++;
+            auto &slot = m_Slots[Sequence % m_Size];
+
+            slot.Sequence = Sequence;
+            slot.Origin = m_Pid;
+            slot.Target = Target;
+            slot.Length = (uint32_t) Payload.Size();
+
+            memcpy(slot.Channel, Channel.c_str(), Channel.Size());
+            slot.Channel[Channel.Size()] = '\0';
+            memcpy(slot.Payload, Payload.c_str(), Payload.Size());
+
+            Unlock();
+
+            Wake(Target);
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        std::string CNotifyRing::WakeupName(pid_t Pid) {
+            // Abstract socket name: nothing on disk to clean up after a crash.
+            std::string Result(1, '\0');
+            Result.append("apostol-ws-notify-" + std::to_string(getppid()) + "-" + std::to_string(Pid));
+            return Result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CNotifyRing::Wake(pid_t Target) const {
+            if (m_Wakeup == -1)
+                return;
+
+            pid_t Readers[WS_NOTIFY_READERS];
+
+            Lock();
+            memcpy(Readers, m_Header->Readers, sizeof(Readers));
+            Unlock();
+
+            const char Signal = 1;
+
+            for (const auto reader : Readers) {
+                if (reader == 0 || reader == m_Pid || (Target != 0 && reader != Target))
+                    continue;
+
+                const auto &caName = WakeupName(reader);
+
+                sockaddr_un Address = {};
+                Address.sun_family = AF_UNIX;
+                memcpy(Address.sun_path, caName.data(), caName.size());
+
+                // A full socket already has a wakeup pending, a missing one belongs to a worker that has gone.
+                sendto(m_Wakeup, &Signal, sizeof(Signal), MSG_DONTWAIT | MSG_NOSIGNAL, (sockaddr *) &Address,
+                       (socklen_t) (offsetof(sockaddr_un, sun_path) + caName.size()));
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CNotifyRing::Drain() const {
+            char Buffer[64];
+            while (m_Wakeup != -1 && recv(m_Wakeup, Buffer, sizeof(Buffer), MSG_DONTWAIT) > 0) {
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        uint64_t CNotifyRing::Read(std::vector<CMessage> &Messages) {
+            if (!Active())
+                return 0;
+
+            uint64_t Missed = 0;
+
+            Lock();
+
+            const auto Last = m_Header->Sequence;
+
+            // The writer has gone round the ring since the last read: the oldest messages are lost.
+            if (Last - m_Sequence > m_Size) {
+                Missed = Last - m_Sequence - m_Size;
+                m_Sequence = Last - m_Size;
+            }
+
+            for (; m_Sequence < Last; ++m_Sequence) {
+                const auto &slot = m_Slots[m_Sequence % m_Size];
+
+                if (slot.Origin == m_Pid || (slot.Target != 0 && slot.Target != m_Pid))
+                    continue;
+
+                Messages.push_back({CString(slot.Channel), CString(slot.Payload, slot.Length)});
+            }
+
+            Unlock();
+
+            return Missed;
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CSessionIndex ---------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSessionIndex::Remove(const CSession *ASession, const CSessionIndex::CEntry &Entry) {
+            const auto sessions = m_Sessions.find(Entry.Session);
+            if (sessions != m_Sessions.end()) {
+                auto &list = sessions->second;
+                list.erase(std::remove(list.begin(), list.end(), ASession), list.end());
+                if (list.empty())
+                    m_Sessions.erase(sessions);
+            }
+
+            const auto identity = m_Identities.find(IdentityKey(Entry.Session, Entry.Identity));
+            if (identity != m_Identities.end() && identity->second == ASession)
+                m_Identities.erase(identity);
+
+            const auto connection = m_Connections.find(Entry.Connection);
+            if (connection != m_Connections.end() && connection->second == ASession)
+                m_Connections.erase(connection);
+
+            if (m_Directory != nullptr && Entry.Connection != nullptr)
+                m_Directory->Remove(Entry.Session.c_str(), Entry.Identity.c_str());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSessionIndex::Add(CSession *ASession) {
+            CEntry Entry;
+
+            Entry.Session = ASession->Session().c_str();
+            Entry.Identity = ASession->Identity().c_str();
+            Entry.Connection = ASession->Connection();
+
+            m_Sessions[Entry.Session].push_back(ASession);
+            m_Identities[IdentityKey(Entry.Session, Entry.Identity)] = ASession;
+            if (Entry.Connection != nullptr) {
+                m_Connections[Entry.Connection] = ASession;
+                if (m_Directory != nullptr)
+                    m_Directory->Add(Entry.Session.c_str(), Entry.Identity.c_str());
+            }
+
+            m_Entries[ASession] = std::move(Entry);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSessionIndex::Update(CSession *ASession) {
+            if (ASession == nullptr)
+                return;
+            Delete(ASession);
+            Add(ASession);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSessionIndex::Delete(CSession *ASession) {
+            const auto it = m_Entries.find(ASession);
+            if (it != m_Entries.end()) {
+                Remove(ASession, it->second);
+                m_Entries.erase(it);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSessionIndex::Disconnect(CHTTPServerConnection *AConnection) {
+            const auto connection = m_Connections.find(AConnection);
+            if (connection == m_Connections.end())
+                return;
+
+            const auto it = m_Entries.find(connection->second);
+            if (it != m_Entries.end()) {
+                it->second.Connection = nullptr;
+                if (m_Directory != nullptr)
+                    m_Directory->Remove(it->second.Session.c_str(), it->second.Identity.c_str());
+            }
+
+            m_Connections.erase(connection);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CSession *CSessionIndex::Find(const CString &Session, const CString &Identity) const {
+            const auto it = m_Identities.find(IdentityKey(Session.c_str(), Identity.c_str()));
+            return it == m_Identities.end() ? nullptr : it->second;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CSession *CSessionIndex::FindByConnection(CHTTPServerConnection *AConnection) const {
+            const auto it = m_Connections.find(AConnection);
+            return it == m_Connections.end() ? nullptr : it->second;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        const std::vector<CSession *> &CSessionIndex::List(const CString &Session) const {
+            static const std::vector<CSession *> Empty;
+            const auto it = m_Sessions.find(Session.c_str());
+            return it == m_Sessions.end() ? Empty : it->second;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CSessionIndex::Clear() {
+            m_Entries.clear();
+            m_Sessions.clear();
+            m_Identities.clear();
+            m_Connections.clear();
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- COutboundQueue --------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        void COutboundQueue::Push(const CString &Payload, bool Droppable) {
+            m_Messages.push_back({Payload, Droppable});
+            m_Size += Payload.Size();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool COutboundQueue::DropOldest() {
+            for (auto it = m_Messages.begin(); it != m_Messages.end(); ++it) {
+                if (it->Droppable) {
+                    m_Size -= it->Payload.Size();
+                    m_Messages.erase(it);
+                    return true;
+                }
+            }
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void COutboundQueue::Pop() {
+            m_Size -= m_Messages.front().Payload.Size();
+            m_Messages.pop_front();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void COutboundQueue::Clear() {
+            m_Messages.clear();
+            m_Size = 0;
+            m_Paused = false;
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CTokenVerifiers -------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CTokenVerifiers {
+        public:
+
+            typedef decltype(jwt::verify()) CVerifier;
+
+            struct CAudience {
+                CStringList Issuers;
+
+                CVerifier HS256 = jwt::verify();
+                CVerifier HS384 = jwt::verify();
+                CVerifier HS512 = jwt::verify();
+            };
+
+        private:
+
+            CString m_Fingerprint;
+
+            std::unordered_map<std::string, std::unique_ptr<CAudience>> m_Audiences;
+
+        public:
+
+            /// Builds the verification data of every application of every provider.
+            CTokenVerifiers(const CString &Fingerprint, const CProviders &Providers): m_Fingerprint(Fingerprint) {
+                for (int i = 0; i < Providers.Count(); ++i) {
+                    const auto& Provider = Providers[i].Value();
+                    const auto& Applications = Provider.Applications();
+
+                    for (int j = 0; j < Applications.Count(); ++j) {
+                        const auto& Application = Applications.Members(j);
+                        const auto& ClientId = Application.Value()[_T("client_id")].AsString();
+
+                        if (ClientId.IsEmpty() || m_Audiences.find(ClientId.c_str()) != m_Audiences.end())
+                            continue;
+
+                        const auto& Secret = OAuth2::Helper::GetSecret(Provider, Application.String());
+
+                        std::unique_ptr<CAudience> pAudience(new CAudience());
+
+                        Provider.GetIssuers(Application.String(), pAudience->Issuers);
+
+                        pAudience->HS256.allow_algorithm(jwt::algorithm::hs256{Secret});
+                        pAudience->HS384.allow_algorithm(jwt::algorithm::hs384{Secret});
+                        pAudience->HS512.allow_algorithm(jwt::algorithm::hs512{Secret});
+
+                        m_Audiences[ClientId.c_str()] = std::move(pAudience);
+                    }
+                }
+            }
+
+            /// Providers configuration the verifiers are built from, see ProvidersFingerprint().
+            const CString &Fingerprint() const { return m_Fingerprint; }
+
+            /// Returns the verification data of a client id.
+            const CAudience *Find(const CString &ClientId) const {
+                const auto it = m_Audiences.find(ClientId.c_str());
+                if (it == m_Audiences.end())
+                    throw COAuth2Error(_T("Not found provider by Client ID."));
+                return it->second.get();
+            }
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CTokenCache -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTokenCache::Capacity(size_t Value) {
+            m_Capacity = Value;
+            while (m_Entries.size() > m_Capacity) {
+                m_Index.erase(m_Entries.back().Token);
+                m_Entries.pop_back();
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CTokenCache::Find(const CString &Token, CString &Subject) {
+            const auto it = m_Index.find(Token.c_str());
+            if (it == m_Index.end())
+                return false;
+
+            if (std::chrono::system_clock::now() >= it->second->Expires) {
+                m_Entries.erase(it->second);
+                m_Index.erase(it);
+                return false;
+            }
+
+            m_Entries.splice(m_Entries.begin(), m_Entries, it->second);
+            Subject = it->second->Subject;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTokenCache::Add(const CString &Token, const CString &Subject, CTimePoint Expires) {
+            if (m_Capacity == 0)
+                return;
+
+            const std::string caToken(Token.c_str());
+
+            const auto it = m_Index.find(caToken);
+            if (it != m_Index.end()) {
+                m_Entries.erase(it->second);
+                m_Index.erase(it);
+            }
+
+            m_Entries.push_front({caToken, Subject, Expires});
+            m_Index[caToken] = m_Entries.begin();
+
+            if (m_Entries.size() > m_Capacity) {
+                m_Index.erase(m_Entries.back().Token);
+                m_Entries.pop_back();
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CTokenCache::Clear() {
+            m_Entries.clear();
+            m_Index.clear();
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CResponseCache --------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CResponseCache::Delete(std::list<CEntry>::iterator Entry) {
+            m_Size -= Entry->Key.size() + Entry->Payload.Size();
+            m_Index.erase(Entry->Key);
+            m_Entries.erase(Entry);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CResponseCache::Limit(size_t Value) {
+            m_Limit = Value;
+            while (m_Size > m_Limit && !m_Entries.empty())
+                Delete(std::prev(m_Entries.end()));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CResponseCache::Find(const CString &Key, CString &Payload) {
+            const auto it = m_Index.find(Key.c_str());
+            if (it == m_Index.end())
+                return false;
+
+            if (std::chrono::steady_clock::now() >= it->second->Expires) {
+                Delete(it->second);
+                return false;
+            }
+
+            m_Entries.splice(m_Entries.begin(), m_Entries, it->second);
+            Payload = it->second->Payload;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CResponseCache::Add(const CString &Key, const CString &Action, const CString &Payload, CTimePoint Expires) {
+            const std::string caKey(Key.c_str());
+            const auto Size = caKey.size() + Payload.Size();
+
+            if (Size > m_Limit)
+                return;
+
+            const auto it = m_Index.find(caKey);
+            if (it != m_Index.end())
+                Delete(it->second);
+
+            m_Entries.push_front({caKey, Action, Payload, Expires});
+            m_Index[caKey] = m_Entries.begin();
+            m_Size += Size;
+
+            while (m_Size > m_Limit)
+                Delete(std::prev(m_Entries.end()));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CResponseCache::HasSegment(const CString &Path, const CString &Segment) {
+            size_t Pos = 0;
+            while (Pos <= Path.Size()) {
+                auto End = Path.Find('/', Pos);
+                if (End == CString::npos)
+                    End = Path.Size();
+
+                if (End - Pos == Segment.Size() && strncmp(Path.c_str() + Pos, Segment.c_str(), Segment.Size()) == 0)
+                    return true;
+
+                Pos = End + 1;
+            }
+
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CResponseCache::Invalidate(const CString &Segment) {
+            if (Segment.IsEmpty()) {
+                const auto Count = m_Entries.size();
+                Clear();
+                return Count;
+            }
+
+            size_t Count = 0;
+            auto it = m_Entries.begin();
+            while (it != m_Entries.end()) {
+                if (HasSegment(it->Action, Segment)) {
+                    auto Next = std::next(it);
+                    Delete(it);
+                    it = Next;
+                    Count++;
+                } else {
+                    ++it;
+                }
+            }
+
+            return Count;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CResponseCache::Clear() {
+            m_Entries.clear();
+            m_Index.clear();
+            m_Size = 0;
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDeflatePool ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDeflatePool::CDeflatePool() {
+            m_Level = Z_DEFAULT_COMPRESSION;
+            m_WindowBits = 15;
+            m_MemLevel = 8;
+            m_Capacity = 64;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CDeflatePool::~CDeflatePool() {
+            Clear();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDeflatePool::Init(int Level, int WindowBits, int MemLevel, size_t Capacity) {
+            Clear();
+
+            m_Level = Level;
+            m_WindowBits = WindowBits < 9 ? 9 : WindowBits > 15 ? 15 : WindowBits;
+            m_MemLevel = MemLevel < 1 ? 1 : MemLevel > 9 ? 9 : MemLevel;
+            m_Capacity = Capacity;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        z_stream *CDeflatePool::Acquire() {
+            if (!m_Streams.empty()) {
+                auto pStream = m_Streams.back();
+                m_Streams.pop_back();
+                return pStream;
+            }
+
+            auto pStream = new z_stream();
+
+            // Negative window bits: raw deflate without zlib header, as in RFC 7692.
+            if (deflateInit2(pStream, m_Level, Z_DEFLATED, -m_WindowBits, m_MemLevel, Z_DEFAULT_STRATEGY) != Z_OK) {
+                delete pStream;
+                return nullptr;
+            }
+
+            return pStream;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDeflatePool::Release(z_stream *AStream) {
+            if (AStream == nullptr)
+                return;
+
+            if (m_Streams.size() < m_Capacity && deflateReset(AStream) == Z_OK) {
+                m_Streams.push_back(AStream);
+            } else {
+                deflateEnd(AStream);
+                delete AStream;
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDeflatePool::Clear() {
+            for (auto pStream : m_Streams) {
+                deflateEnd(pStream);
+                delete pStream;
+            }
+            m_Streams.clear();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDeflatePool::Deflate(z_stream *AStream, const CString &Data, CString &Result) {
+            std::string Buffer;
+            Buffer.resize(deflateBound(AStream, Data.Size()) + 16);
+
+            AStream->next_in = (Bytef *) Data.c_str();
+            AStream->avail_in = (uInt) Data.Size();
+
+            size_t Length = 0;
+
+            do {
+                if (Length == Buffer.size())
+                    Buffer.resize(Buffer.size() * 2);
+
+                AStream->next_out = (Bytef *) &Buffer[Length];
+                AStream->avail_out = (uInt) (Buffer.size() - Length);
+
+                const auto Status = deflate(AStream, Z_SYNC_FLUSH);
+                if (Status != Z_OK && Status != Z_BUF_ERROR)
+                    return false;
+
+                Length = Buffer.size() - AStream->avail_out;
+            } while (AStream->avail_out == 0);
+
+            // Z_SYNC_FLUSH ends with an empty stored block (00 00 FF FF) that the receiver appends back.
+            if (Length >= 4)
+                Length -= 4;
+
+            Result = CString(Buffer.data(), Length);
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CDeflatePool::Inflate(z_stream *AStream, const CString &Data, CString &Result, size_t Limit) {
+            static const unsigned char Tail[4] = {0x00, 0x00, 0xFF, 0xFF};
+
+            std::string Input(Data.c_str(), Data.Size());
+            Input.append((const char *) Tail, sizeof(Tail));
+
+            std::string Buffer;
+            Buffer.resize(std::min(Input.size() * 4 + 256, Limit + 1));
+
+            AStream->next_in = (Bytef *) &Input[0];
+            AStream->avail_in = (uInt) Input.size();
+
+            size_t Length = 0;
+
+            do {
+                // Stop as soon as the output exceeds the limit, a small frame may expand to gigabytes.
+                if (Length > Limit)
+                    return false;
+
+                if (Length == Buffer.size())
+                    Buffer.resize(std::min(Buffer.size() * 2, Limit + 1));
+
+                AStream->next_out = (Bytef *) &Buffer[Length];
+                AStream->avail_out = (uInt) (Buffer.size() - Length);
+
+                const auto Status = inflate(AStream, Z_SYNC_FLUSH);
+                if (Status != Z_OK && Status != Z_BUF_ERROR && Status != Z_STREAM_END)
+                    return false;
+
+                Length = Buffer.size() - AStream->avail_out;
+            } while (AStream->avail_out == 0);
+
+            Result = CString(Buffer.data(), Length);
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        z_stream *CDeflatePool::NewInflate() {
+            auto pStream = new z_stream();
+
+            if (inflateInit2(pStream, -15) != Z_OK) {
+                delete pStream;
+                return nullptr;
+            }
+
+            return pStream;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CDeflatePool::FreeInflate(z_stream *AStream) {
+            if (AStream != nullptr) {
+                inflateEnd(AStream);
+                delete AStream;
+            }
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CMsgPack --------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CMsgPack::WriteInteger(std::string &Buffer, int64_t Value) {
+            if (Value >= 0 && Value < 128) {
+                Buffer.push_back((char) Value);
+            } else if (Value < 0 && Value >= -32) {
+                Buffer.push_back((char) (0xE0 | (Value + 32)));
+            } else {
+                Buffer.push_back((char) 0xD3); // int 64
+                for (int i = 7; i >= 0; --i)
+                    Buffer.push_back((char) (((uint64_t) Value >> (i * 8)) & 0xFF));
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CMsgPack::WriteString(std::string &Buffer, const char *Data, size_t Size) {
+            if (Size < 32) {
+                Buffer.push_back((char) (0xA0 | Size));
+            } else if (Size <= 0xFF) {
+                Buffer.push_back((char) 0xD9);
+                Buffer.push_back((char) Size);
+            } else if (Size <= 0xFFFF) {
+                Buffer.push_back((char) 0xDA);
+                Buffer.push_back((char) ((Size >> 8) & 0xFF));
+                Buffer.push_back((char) (Size & 0xFF));
+            } else {
+                Buffer.push_back((char) 0xDB);
+                for (int i = 3; i >= 0; --i)
+                    Buffer.push_back((char) ((Size >> (i * 8)) & 0xFF));
+            }
+
+            Buffer.append(Data, Size);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CMsgPack::ReadInteger(const unsigned char *&Data, const unsigned char *End, int64_t &Value) {
+            if (Data >= End)
+                return false;
+
+            const auto Type = *Data++;
+
+            if (Type < 0x80) {
+                Value = Type;
+                return true;
+            }
+
+            if (Type >= 0xE0) {
+                Value = (int8_t) Type;
+                return true;
+            }
+
+            size_t Size;
+            bool bSigned = false;
+
+            switch (Type) {
+                case 0xCC: Size = 1; break;
+                case 0xCD: Size = 2; break;
+                case 0xCE: Size = 4; break;
+                case 0xCF: Size = 8; break;
+                case 0xD0: Size = 1; bSigned = true; break;
+                case 0xD1: Size = 2; bSigned = true; break;
+                case 0xD2: Size = 4; bSigned = true; break;
+                case 0xD3: Size = 8; bSigned = true; break;
+                default:
+                    return false;
+            }
+
+            if ((size_t) (End - Data) < Size)
+                return false;
+
+            uint64_t Raw = 0;
+            for (size_t i = 0; i < Size; ++i)
+                Raw = (Raw << 8) | *Data++;
+
+            if (bSigned && Size < 8 && (Raw & (1ULL << (Size * 8 - 1))))
+                Raw |= ~0ULL << (Size * 8); // sign extension
+
+            Value = (int64_t) Raw;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CMsgPack::ReadString(const unsigned char *&Data, const unsigned char *End, CString &Value) {
+            if (Data >= End)
+                return false;
+
+            const auto Type = *Data++;
+
+            size_t Length = 0;
+            size_t Size;
+
+            if ((Type & 0xE0) == 0xA0) {
+                Length = Type & 0x1F;
+                Size = 0;
+            } else {
+                switch (Type) {
+                    case 0xC0: // nil
+                        Value.Clear();
+                        return true;
+                    case 0xD9: case 0xC4: Size = 1; break;
+                    case 0xDA: case 0xC5: Size = 2; break;
+                    case 0xDB: case 0xC6: Size = 4; break;
+                    default:
+                        return false;
+                }
+            }
+
+            if ((size_t) (End - Data) < Size)
+                return false;
+
+            for (size_t i = 0; i < Size; ++i)
+                Length = (Length << 8) | *Data++;
+
+            if ((size_t) (End - Data) < Length)
+                return false;
+
+            Value = CString((const char *) Data, Length);
+            Data += Length;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CMsgPack::ScanString(const char *&Data, const char *End, std::string &Value) {
+            if (Data >= End || *Data != '"')
+                return false;
+
+            Data++;
+
+            while (Data < End && *Data != '"') {
+                if (*Data != '\\') {
+                    Value.push_back(*Data++);
+                    continue;
+                }
+
+                if (++Data >= End)
+                    return false;
+
+                switch (*Data++) {
+                    case '"': Value.push_back('"'); break;
+                    case '\\': Value.push_back('\\'); break;
+                    case '/': Value.push_back('/'); break;
+                    case 'b': Value.push_back('\b'); break;
+                    case 'f': Value.push_back('\f'); break;
+                    case 'n': Value.push_back('\n'); break;
+                    case 'r': Value.push_back('\r'); break;
+                    case 't': Value.push_back('\t'); break;
+                    case 'u': {
+                        if (End - Data < 4)
+                            return false;
+
+                        uint32_t Code = (uint32_t) strtoul(std::string(Data, 4).c_str(), nullptr, 16);
+                        Data += 4;
+
+                        if (Code >= 0xD800 && Code < 0xDC00 && End - Data >= 6 && Data[0] == '\\' && Data[1] == 'u') {
+                            const auto Low = (uint32_t) strtoul(std::string(Data + 2, 4).c_str(), nullptr, 16);
+                            if (Low >= 0xDC00 && Low < 0xE000) {
+                                Code = 0x10000 + ((Code - 0xD800) << 10) + (Low - 0xDC00);
+                                Data += 6;
+                            }
+                        }
+
+                        if (Code < 0x80) {
+                            Value.push_back((char) Code);
+                        } else if (Code < 0x800) {
+                            Value.push_back((char) (0xC0 | (Code >> 6)));
+                            Value.push_back((char) (0x80 | (Code & 0x3F)));
+                        } else if (Code < 0x10000) {
+                            Value.push_back((char) (0xE0 | (Code >> 12)));
+                            Value.push_back((char) (0x80 | ((Code >> 6) & 0x3F)));
+                            Value.push_back((char) (0x80 | (Code & 0x3F)));
+                        } else {
+                            Value.push_back((char) (0xF0 | (Code >> 18)));
+                            Value.push_back((char) (0x80 | ((Code >> 12) & 0x3F)));
+                            Value.push_back((char) (0x80 | ((Code >> 6) & 0x3F)));
+                            Value.push_back((char) (0x80 | (Code & 0x3F)));
+                        }
+
+                        break;
+                    }
+                    default:
+                        return false;
+                }
+            }
+
+            if (Data >= End)
+                return false;
+
+            Data++;
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CMsgPack::ScanValue(const char *&Data, const char *End) {
+            // Skips one JSON value without building it: only brackets and string boundaries are tracked.
+            int Depth = 0;
+            bool bString = false;
+
+            while (Data < End) {
+                const auto ch = *Data;
+
+                if (bString) {
+                    if (ch == '\\') {
+                        Data++;
+                    } else if (ch == '"') {
+                        bString = false;
+                        if (Depth == 0) {
+                            Data++;
+                            return true;
+                        }
+                    }
+                } else if (ch == '"') {
+                    bString = true;
+                } else if (ch == '{' || ch == '[') {
+                    Depth++;
+                } else if (ch == '}' || ch == ']') {
+                    if (Depth == 0)
+                        return true;
+                    if (--Depth == 0) {
+                        Data++;
+                        return true;
+                    }
+                } else if (ch == ',' && Depth == 0) {
+                    return true;
+                }
+
+                Data++;
+            }
+
+            return Depth == 0 && !bString;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CMsgPack::ScanLiteral(const char *&Data, const char *End) {
+            const auto Length = End - Data;
+
+            if (Length >= 4 && (strncmp(Data, "null", 4) == 0 || strncmp(Data, "true", 4) == 0)) {
+                Data += 4;
+                return true;
+            }
+
+            if (Length >= 5 && strncmp(Data, "false", 5) == 0) {
+                Data += 5;
+                return true;
+            }
+
+            const auto Digits = [&Data, End]() {
+                const auto Start = Data;
+                while (Data < End && isdigit((unsigned char) *Data))
+                    Data++;
+                return Data > Start;
+            };
+
+            if (Data < End && *Data == '-')
+                Data++;
+
+            if (Data < End && *Data == '0') {
+                Data++;
+            } else if (!Digits()) {
+                return false;
+            }
+
+            if (Data < End && *Data == '.') {
+                Data++;
+                if (!Digits())
+                    return false;
+            }
+
+            if (Data < End && (*Data == 'e' || *Data == 'E')) {
+                Data++;
+                if (Data < End && (*Data == '+' || *Data == '-'))
+                    Data++;
+                if (!Digits())
+                    return false;
+            }
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CMsgPack::Valid(const CString &Json) {
+            const char *Data = Json.c_str();
+            const char *End = Data + Json.Size();
+
+            // Open brackets, the text is never converted into values.
+            std::string Stack;
+            std::string Key;
+
+            const auto SkipSpace = [&Data, End]() {
+                while (Data < End && isspace((unsigned char) *Data))
+                    Data++;
+            };
+
+            const auto ReadKey = [&Data, End, &Key, &SkipSpace]() {
+                SkipSpace();
+                Key.clear();
+                if (!ScanString(Data, End, Key))
+                    return false;
+                SkipSpace();
+                return Data < End && *Data++ == ':';
+            };
+
+            for (;;) {
+                SkipSpace();
+                if (Data >= End)
+                    return false;
+
+                const auto ch = *Data;
+
+                if (ch == '{' || ch == '[') {
+                    Data++;
+                    SkipSpace();
+
+                    if (Data < End && *Data == (ch == '{' ? '}' : ']')) {
+                        Data++;
+                    } else {
+                        Stack.push_back(ch);
+                        if (ch == '{' && !ReadKey())
+                            return false;
+                        continue;
+                    }
+                } else if (ch == '"') {
+                    Key.clear();
+                    if (!ScanString(Data, End, Key))
+                        return false;
+                } else if (!ScanLiteral(Data, End)) {
+                    return false;
+                }
+
+                // After a value comes the next member or element, or the closing brackets.
+                for (;;) {
+                    SkipSpace();
+
+                    if (Stack.empty())
+                        return Data == End;
+
+                    if (Data >= End)
+                        return false;
+
+                    if (*Data == ',') {
+                        Data++;
+                        if (Stack.back() == '{' && !ReadKey())
+                            return false;
+                        break;
+                    }
+
+                    if (*Data++ != (Stack.back() == '{' ? '}' : ']'))
+                        return false;
+
+                    Stack.pop_back();
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CMsgPack::Encode(const CString &Json, CString &Result) {
+            const char *Data = Json.c_str();
+            const char *End = Data + Json.Size();
+
+            const auto SkipSpace = [&Data, End]() {
+                while (Data < End && isspace((unsigned char) *Data))
+                    Data++;
+            };
+
+            SkipSpace();
+            if (Data >= End || *Data++ != '{')
+                return false;
+
+            std::string Body;
+            Body.reserve(Json.Size() + 16);
+
+            size_t Count = 0;
+
+            SkipSpace();
+            while (Data < End && *Data != '}') {
+                std::string Key;
+
+                if (!ScanString(Data, End, Key))
+                    return false;
+
+                SkipSpace();
+                if (Data >= End || *Data++ != ':')
+                    return false;
+                SkipSpace();
+
+                const auto Start = Data;
+                if (!ScanValue(Data, End))
+                    return false;
+
+                auto Length = (size_t) (Data - Start);
+                while (Length > 0 && isspace((unsigned char) Start[Length - 1]))
+                    Length--;
+
+                WriteString(Body, Key.data(), Key.size());
+
+                if (Key == "p") {
+                    WriteString(Body, Start, Length);
+                } else if (*Start == '"') {
+                    std::string Value;
+                    const char *Pos = Start;
+                    if (!ScanString(Pos, Start + Length, Value))
+                        return false;
+                    WriteString(Body, Value.data(), Value.size());
+                } else if (Length == 4 && strncmp(Start, "null", 4) == 0) {
+                    Body.push_back((char) 0xC0);
+                } else if (Length == 4 && strncmp(Start, "true", 4) == 0) {
+                    Body.push_back((char) 0xC3);
+                } else if (Length == 5 && strncmp(Start, "false", 5) == 0) {
+                    Body.push_back((char) 0xC2);
+                } else if (*Start == '-' || isdigit((unsigned char) *Start)) {
+                    WriteInteger(Body, strtoll(Start, nullptr, 10));
+                } else {
+                    WriteString(Body, Start, Length);
+                }
+
+                Count++;
+
+                SkipSpace();
+                if (Data < End && *Data == ',') {
+                    Data++;
+                    SkipSpace();
+                }
+            }
+
+            std::string Buffer;
+            Buffer.reserve(Body.size() + 3);
+
+            if (Count < 16) {
+                Buffer.push_back((char) (0x80 | Count));
+            } else {
+                Buffer.push_back((char) 0xDE);
+                Buffer.push_back((char) ((Count >> 8) & 0xFF));
+                Buffer.push_back((char) (Count & 0xFF));
+            }
+
+            Buffer.append(Body);
+
+            Result = CString(Buffer.data(), Buffer.size());
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CMsgPack::Decode(const CString &Data, CWSMessage &Message, CString &Payload) {
+            auto Pos = (const unsigned char *) Data.c_str();
+            const auto End = Pos + Data.Size();
+
+            if (Pos >= End)
+                return false;
+
+            size_t Count;
+            const auto Type = *Pos++;
+
+            if ((Type & 0xF0) == 0x80) {
+                Count = Type & 0x0F;
+            } else if (Type == 0xDE && End - Pos >= 2) {
+                Count = (Pos[0] << 8) | Pos[1];
+                Pos += 2;
+            } else {
+                return false;
+            }
+
+            for (size_t i = 0; i < Count; ++i) {
+                CString Key;
+                if (!ReadString(Pos, End, Key))
+                    return false;
+
+                if (Key == "t" || Key == "c") {
+                    int64_t Value;
+                    if (!ReadInteger(Pos, End, Value))
+                        return false;
+
+                    if (Key == "t") {
+                        Message.MessageTypeId = static_cast<decltype(Message.MessageTypeId)> (Value);
+                    } else {
+                        Message.ErrorCode = (int) Value;
+                    }
+                } else {
+                    CString Value;
+                    if (!ReadString(Pos, End, Value))
+                        return false;
+
+                    if (Key == "u") {
+                        Message.UniqueId = Value;
+                    } else if (Key == "a") {
+                        Message.Action = Value;
+                    } else if (Key == "m") {
+                        Message.ErrorMessage = Value;
+                    } else if (Key == "p") {
+                        Payload = Value;
+                    }
+                }
+            }
+
+            return Pos == End;
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CMsgPack::Split(const CString &Json, CWSMessage &Message, CString &Payload) {
+            const char *Data = Json.c_str();
+            const char *End = Data + Json.Size();
+
+            const auto SkipSpace = [&Data, End]() {
+                while (Data < End && isspace((unsigned char) *Data))
+                    Data++;
+            };
+
+            SkipSpace();
+            if (Data >= End || *Data++ != '{')
+                return false;
+
+            SkipSpace();
+            while (Data < End && *Data != '}') {
+                std::string Key;
+
+                if (!ScanString(Data, End, Key))
+                    return false;
+
+                SkipSpace();
+                if (Data >= End || *Data++ != ':')
+                    return false;
+                SkipSpace();
+
+                const auto Start = Data;
+                if (!ScanValue(Data, End))
+                    return false;
+
+                auto Length = (size_t) (Data - Start);
+                while (Length > 0 && isspace((unsigned char) Start[Length - 1]))
+                    Length--;
+
+                if (Length == 0)
+                    return false;
+
+                if (Key == "p") {
+                    Payload = CString(Start, Length);
+                } else if (Key == "t" || Key == "c") {
+                    if (*Start != '-' && !isdigit((unsigned char) *Start))
+                        return false;
+
+                    const auto Value = strtol(Start, nullptr, 10);
+
+                    if (Key == "t") {
+                        Message.MessageTypeId = static_cast<decltype(Message.MessageTypeId)> (Value);
+                    } else {
+                        Message.ErrorCode = (int) Value;
+                    }
+                } else if (*Start == '"') {
+                    std::string Value;
+                    const char *Pos = Start;
+                    if (!ScanString(Pos, Start + Length, Value))
+                        return false;
+
+                    if (Key == "u") {
+                        Message.UniqueId = CString(Value.data(), Value.size());
+                    } else if (Key == "a") {
+                        Message.Action = CString(Value.data(), Value.size());
+                    } else if (Key == "m") {
+                        Message.ErrorMessage = CString(Value.data(), Value.size());
+                    }
+                } else if (Key == "u" || Key == "a" || Key == "m") {
+                    return false;
+                }
+
+                SkipSpace();
+                if (Data < End && *Data == ',') {
+                    Data++;
+                    SkipSpace();
+                }
+            }
+
+            if (Data >= End)
+                return false;
+
+            Data++;
+            SkipSpace();
+
+            return Data == End;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CMetrics --------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        static const double HistogramBounds[CHistogram::BucketCount] = {
+            0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 25, 60
+        };
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHistogram::Observe(double Seconds) {
+            size_t Index = 0;
+            while (Index < BucketCount && Seconds > HistogramBounds[Index])
+                Index++;
+
+            m_Buckets[Index]++;
+            m_Count++;
+            m_Sum += Seconds;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CHistogram::Write(std::string &Output, const char *Name, const std::string &Labels) const {
+            char Number[32];
+            uint64_t Total = 0;
+
+            // Buckets are kept separately and written cumulatively, as Prometheus expects.
+            for (size_t i = 0; i <= BucketCount; ++i) {
+                Total += m_Buckets[i];
+
+                if (i < BucketCount) {
+                    snprintf(Number, sizeof(Number), "%g", HistogramBounds[i]);
+                } else {
+                    strcpy(Number, "+Inf");
+                }
+
+                Output.append(Name).append("_bucket{").append(Labels).append(Labels.empty() ? "" : ",");
+                Output.append("le=\"").append(Number).append("\"} ").append(std::to_string(Total)).push_back('\n');
+            }
+
+            snprintf(Number, sizeof(Number), "%.6f", m_Sum);
+
+            Output.append(Name).append("_sum{").append(Labels).append("} ").append(Number).push_back('\n');
+            Output.append(Name).append("_count{").append(Labels).append("} ").append(std::to_string(m_Count)).push_back('\n');
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CMetrics::Label(std::string &Output, const char *Name, const std::string &Value) {
+            Output.append(Name).append("=\"");
+            for (const auto ch : Value) {
+                if (ch == '\\' || ch == '"') {
+                    Output.push_back('\\');
+                    Output.push_back(ch);
+                } else if (ch == '\n') {
+                    Output.append("\\n");
+                } else {
+                    Output.push_back(ch);
+                }
+            }
+            Output.push_back('"');
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CMetrics::Call(const CString &Action, double Seconds) {
+            // Actions come from clients: their number is capped so a scan of random paths cannot grow the table.
+            auto it = m_Calls.find(Action.c_str());
+            if (it == m_Calls.end())
+                it = m_Calls.emplace(m_Calls.size() < MaxActions ? Action.c_str() : "other", CHistogram()).first;
+
+            it->second.Observe(Seconds);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CMetrics::Query(const CString &Statement, double Seconds) {
+            m_Queries[Statement.c_str()].Observe(Seconds);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CMetrics::Write(std::string &Output) const {
+            std::string Labels;
+
+            const auto Counter = [&Output](const char *Name, const char *Help) {
+                Output.append("# HELP ").append(Name).append(" ").append(Help).push_back('\n');
+                Output.append("# TYPE ").append(Name).append(" counter\n");
+            };
+
+            const auto Histogram = [&Output](const char *Name, const char *Help) {
+                Output.append("# HELP ").append(Name).append(" ").append(Help).push_back('\n');
+                Output.append("# TYPE ").append(Name).append(" histogram\n");
+            };
+
+            Histogram("ws_call_duration_seconds", "Time from receiving a call to writing its reply.");
+            for (const auto &call : m_Calls) {
+                Labels.clear();
+                Label(Labels, "action", call.first);
+                call.second.Write(Output, "ws_call_duration_seconds", Labels);
+            }
+
+            Histogram("ws_query_duration_seconds", "Time from submitting a fetch query to its result.");
+            for (const auto &query : m_Queries) {
+                Labels.clear();
+                Label(Labels, "statement", query.first);
+                query.second.Write(Output, "ws_query_duration_seconds", Labels);
+            }
+
+            Counter("ws_notifications_total", "Notifications received per publisher.");
+            for (const auto &notification : m_Notifications) {
+                Labels.clear();
+                Label(Labels, "publisher", notification.first);
+                Output.append("ws_notifications_total{").append(Labels).append("} ").append(std::to_string(notification.second)).push_back('\n');
+            }
+
+            Counter("ws_observer_queries_total", "Observer queries issued per publisher.");
+            for (const auto &observer : m_Observers) {
+                Labels.clear();
+                Label(Labels, "publisher", observer.first);
+                Output.append("ws_observer_queries_total{").append(Labels).append("} ").append(std::to_string(observer.second.Queries)).push_back('\n');
+            }
+
+            Counter("ws_observer_rows_total", "Rows returned by observer queries per publisher.");
+            for (const auto &observer : m_Observers) {
+                Labels.clear();
+                Label(Labels, "publisher", observer.first);
+                Output.append("ws_observer_rows_total{").append(Labels).append("} ").append(std::to_string(observer.second.Rows)).push_back('\n');
+            }
+
+            Counter("ws_messages_received_total", "WebSocket messages received.");
+            Output.append("ws_messages_received_total ").append(std::to_string(m_MessagesIn)).push_back('\n');
+
+            Counter("ws_messages_sent_total", "WebSocket messages sent.");
+            Output.append("ws_messages_sent_total ").append(std::to_string(m_MessagesOut)).push_back('\n');
+
+            Counter("ws_received_bytes_total", "WebSocket payload bytes received.");
+            Output.append("ws_received_bytes_total ").append(std::to_string(m_BytesIn)).push_back('\n');
+
+            Counter("ws_sent_bytes_total", "WebSocket payload bytes sent, after compression.");
+            Output.append("ws_sent_bytes_total ").append(std::to_string(m_BytesOut)).push_back('\n');
+        }
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CWebSocketAPI ---------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        // Names of CQueryClass values in settings and metrics.
+        static const char *QueryClassNames[qcCount] = {"interactive", "auth", "observer"};
+        //--------------------------------------------------------------------------------------------------------------
+
+        CWebSocketAPI::CWebSocketAPI(CModuleProcess *AProcess) : CApostolModule(AProcess, "web socket api") {
+            m_Headers.Add("Authorization");
+            m_Headers.Add("Session");
+            m_Headers.Add("Secret");
+
+            m_ListenPending = false;
+            m_ListenReplay = false;
+            m_ListenBackoff = 0;
+            m_ListenRetry = 0;
+            m_ListenSeen = 0;
+            m_Listener = nullptr;
+
+            m_ObserverBatch = false;
+            m_ObserverBatchSize = 500;
+            m_ObserverLocal = false;
+
+            m_BroadcastSharedId = false;
+
+            m_OutboundHighWatermark = 1024 * 1024;
+            m_OutboundLowWatermark = 256 * 1024;
+            m_OutboundLimit = 8 * 1024 * 1024;
+            m_OutboundCloseSlow = false;
+
+            m_MsgPack = true;
+
+            m_PreparedStatements = false;
+            m_TrustedSecret = false;
+
+            m_Pipeline = false;
+            m_PipelineDepth = 16;
+
+            m_Collector = nullptr;
+
+            m_TokenCacheTTL = std::chrono::seconds(300);
+            m_TokenVerifiers = std::make_shared<CTokenVerifiers>(CString(), CProviders());
+
+            m_CacheTTL = std::chrono::seconds(30);
+            m_CacheGeneration = 0;
+
+            m_RateLimit = 0;
+            m_RateBurst = 20;
+
+            m_MaxInFlight = 0;
+            m_AdmissionLimit = 1000;
+            m_StreamChunk = 0;
+            m_NotifyLeader = false;
+            m_NotifyHandler = nullptr;
+            m_InFlightCalls = 0;
+
+            m_SchedulerSlots = 0;
+
+            for (int i = 0; i < qcCount; ++i) {
+                m_Reserve[i] = 0;
+                m_Weight[i] = 1;
+                m_Credit[i] = 0;
+                m_Running[i] = 0;
+            }
+
+            m_Deflate = true;
+            m_DeflateThreshold = 1024;
+            m_DeflateContextTakeover = false;
+
+            m_MaxMessageSize = 1048576;
+
+            CWebSocketAPI::InitMethods();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::InitMethods() {
+#if defined(_GLIBCXX_RELEASE) && (_GLIBCXX_RELEASE >= 9)
+            m_pMethods->AddObject(_T("GET")    , (CObject *) new CMethodHandler(true , [this](auto && Connection) { DoGet(Connection); }));
+            m_pMethods->AddObject(_T("POST")   , (CObject *) new CMethodHandler(true , [this](auto && Connection) { DoPost(Connection); }));
+            m_pMethods->AddObject(_T("OPTIONS"), (CObject *) new CMethodHandler(true , [this](auto && Connection) { DoOptions(Connection); }));
+            m_pMethods->AddObject(_T("HEAD")   , (CObject *) new CMethodHandler(false, [this](auto && Connection) { MethodNotAllowed(Connection); }));
+            m_pMethods->AddObject(_T("PUT")    , (CObject *) new CMethodHandler(false, [this](auto && Connection) { MethodNotAllowed(Connection); }));
+            m_pMethods->AddObject(_T("DELETE") , (CObject *) new CMethodHandler(false, [this](auto && Connection) { MethodNotAllowed(Connection); }));
+            m_pMethods->AddObject(_T("TRACE")  , (CObject *) new CMethodHandler(false, [this](auto && Connection) { MethodNotAllowed(Connection); }));
+            m_pMethods->AddObject(_T("PATCH")  , (CObject *) new CMethodHandler(false, [this](auto && Connection) { MethodNotAllowed(Connection); }));
+            m_pMethods->AddObject(_T("CONNECT"), (CObject *) new CMethodHandler(false, [this](auto && Connection) { MethodNotAllowed(Connection); }));
+#else
+            m_pMethods->AddObject(_T("GET")    , (CObject *) new CMethodHandler(true , std::bind(&CWebSocketAPI::DoGet, this, _1)));
+            m_pMethods->AddObject(_T("POST")   , (CObject *) new CMethodHandler(true , std::bind(&CWebSocketAPI::DoPost, this, _1)));
+            m_pMethods->AddObject(_T("OPTIONS"), (CObject *) new CMethodHandler(true , std::bind(&CWebSocketAPI::DoOptions, this, _1)));
+            m_pMethods->AddObject(_T("HEAD")   , (CObject *) new CMethodHandler(false, std::bind(&CWebSocketAPI::MethodNotAllowed, this, _1)));
+            m_pMethods->AddObject(_T("PUT")    , (CObject *) new CMethodHandler(false, std::bind(&CWebSocketAPI::MethodNotAllowed, this, _1)));
+            m_pMethods->AddObject(_T("DELETE") , (CObject *) new CMethodHandler(false, std::bind(&CWebSocketAPI::MethodNotAllowed, this, _1)));
+            m_pMethods->AddObject(_T("TRACE")  , (CObject *) new CMethodHandler(false, std::bind(&CWebSocketAPI::MethodNotAllowed, this, _1)));
+            m_pMethods->AddObject(_T("PATCH")  , (CObject *) new CMethodHandler(false, std::bind(&CWebSocketAPI::MethodNotAllowed, this, _1)));
+            m_pMethods->AddObject(_T("CONNECT"), (CObject *) new CMethodHandler(false, std::bind(&CWebSocketAPI::MethodNotAllowed, this, _1)));
+#endif
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        int CWebSocketAPI::CheckError(const CJSON &Json, CString &ErrorMessage, bool RaiseIfError) {
+            int errorCode = 0;
+
+            if (Json.HasOwnProperty(_T("error"))) {
+                const auto& error = Json[_T("error")];
+
+                if (error.HasOwnProperty(_T("code"))) {
+                    errorCode = error[_T("code")].AsInteger();
+                } else {
+                    errorCode = 40000;
+                }
+
+                if (error.HasOwnProperty(_T("message"))) {
+                    ErrorMessage = error[_T("message")].AsString();
+                } else {
+                    ErrorMessage = _T("Invalid request.");
+                }
+
+                if (RaiseIfError)
+                    throw EDBError(ErrorMessage.c_str());
+
+                if (errorCode >= 10000)
+                    errorCode = errorCode / 100;
+
+                if (errorCode < 0)
+                    errorCode = 400;
+            }
+
+            return errorCode;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CHTTPReply::CStatusType CWebSocketAPI::ErrorCodeToStatus(int ErrorCode) {
+            CHTTPReply::CStatusType Status = CHTTPReply::ok;
+
+            if (ErrorCode != 0) {
+                switch (ErrorCode) {
+                    case 401:
+                        Status = CHTTPReply::unauthorized;
+                        break;
+
+                    case 403:
+                        Status = CHTTPReply::forbidden;
+                        break;
+
+                    case 404:
+                        Status = CHTTPReply::not_found;
+                        break;
+
+                    case 500:
+                        Status = CHTTPReply::internal_server_error;
+                        break;
+
+                    default:
+                        Status = CHTTPReply::bad_request;
+                        break;
+                }
+            }
+
+            return Status;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CWebSocketAPI::IsObserverAction(const CString &Action) {
+            return Action == _T("/api/v1/observer/subscribe") || Action == _T("/api/v1/observer/unsubscribe") ||
+                   Action == _T("/api/v1/observer/listener/set");
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::AfterQuery(CHTTPServerConnection *AConnection, const CString &Path, const CJSON &Payload) {
+
+            auto pSession = CSession::FindOfConnection(AConnection);
+
+            auto SignIn = [pSession](const CJSON &Payload) {
+
+                const auto& session = Payload[_T("session")].AsString();
+                const auto& secret = Payload[_T("secret")].AsString();
+
+                pSession->Session() = session;
+                pSession->Secret() = secret;
+
+                pSession->Authorized(true);
+            };
+
+            auto SignOut = [pSession](const CJSON &Payload) {
+                pSession->Secret().Clear();
+                pSession->Authorization().Clear();
+                pSession->Authorized(false);
+            };
+
+            auto Authorize = [pSession](const CJSON &Payload) {
+
+                if (Payload.HasOwnProperty(_T("authorized"))) {
+                    pSession->Authorized(Payload[_T("authorized")].AsBoolean());
+                }
+
+                if (!pSession->Authorized()) {
+                    pSession->Secret().Clear();
+                    pSession->Authorization().Clear();
+
+                    const auto& message = Payload[_T("message")].AsString();
+                    throw Delphi::Exception::Exception(message.IsEmpty() ? _T("Unknown error.") : message.c_str());
+                }
+            };
+
+            if (Path == _T("/api/v1/sign/in")) {
+                SignIn(Payload);
+            } else if (Path == _T("/api/v1/sign/out")) {
+                SignOut(Payload);
+            } else if (Path == _T("/api/v1/authenticate")) {
+                Authorize(Payload);
+            } else if (Path == _T("/api/v1/authorize")) {
+                Authorize(Payload);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::DoPostgresNotify(CPQConnection *AConnection, PGnotify *ANotify) {
+#ifdef _DEBUG
+            const auto& Info = AConnection->ConnInfo();
+
+            DebugMessage("[NOTIFY] [%d] [postgresql://%s@%s:%s/%s] [PID: %d] [%s] %s\n",
+                AConnection->Socket(), Info["user"].c_str(), Info["host"].c_str(), Info["port"].c_str(), Info["dbname"].c_str(),
+                ANotify->be_pid, ANotify->relname, ANotify->extra);
+#endif
+            const CString caPublisher(ANotify->relname);
+            const CString caData(ANotify->extra);
+
+            // The other workers of the host do not listen themselves and get the message from the ring.
+            if (m_NotifyRing.Active())
+                m_NotifyRing.Publish(caPublisher, caData);
+
+            Notify(caPublisher, caData);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::Notify(const CString &Publisher, const CString &Data) {
+
+            if (!m_RelayChannel.IsEmpty() && Publisher == m_RelayChannel) {
+                DoRelay(Data);
+                return;
+            }
+
+            m_Metrics.Notification(Publisher);
+
+            CObserverFilter::CEvent Event;
+            CObserverFilter::Parse(Data, Event);
+
+            InvalidateCache(Publisher, Event);
+
+            std::vector<CSession *> Sessions;
+            std::vector<CHTTPServerConnection *> Connections;
+
+            for (int i = 0; i < m_SessionManager.Count(); ++i) {
+                auto pSession = m_SessionManager[i];
+
+                if (!pSession->Authorized())
+                    continue;
+
+                if ((m_ObserverIndex.Prune() || m_ObserverLocal) && !m_ObserverIndex.Known(pSession->Session()))
+                    ObserverDiscovery(pSession);
+
+                const auto match = m_ObserverIndex.Match(pSession->Session(), Publisher, Event);
+
+                if (match == omSkip)
+                    continue;
+
+                if (match == omDeliver && m_ObserverLocal) {
+                    auto pConnection = pSession->Connection();
+                    if (pConnection != nullptr && !pConnection->ClosedGracefully())
+                        Connections.push_back(pConnection);
+                    continue;
+                }
+
+                Sessions.push_back(pSession);
+            }
+
+            DoBroadcast(Connections, "/" + Publisher, Data);
+
+            if (m_ObserverBatch) {
+                ObserverBatch(Publisher, Data, Sessions);
+            } else {
+                for (auto pSession : Sessions)
+                    Observer(pSession, Publisher, Data);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::DoPostgresQueryExecuted(CPQPollQuery *APollQuery) {
+
+            auto pResult = APollQuery->Results(APollQuery->ResultCount() - 1);
+
+            if (pResult->ExecStatus() != PGRES_TUPLES_OK) {
+                QueryException(APollQuery, Delphi::Exception::EDBError(pResult->GetErrorMessage()));
+                return;
+            }
+
+            if (APollQuery->Data()[_T("Discovery")] == _T("true")) {
+                DoObserverDiscovery(APollQuery);
+                return;
+            }
+
+            auto pConnection = dynamic_cast<CHTTPServerConnection *> (APollQuery->Binding());
+
+            if (pConnection != nullptr && pConnection->ClosedGracefully())
+                pConnection = nullptr;
+
+            const auto &caKey = APollQuery->Data()[_T("Coalesce")];
+
+            // Coalesced callers still get the result if the one who sent the query has gone.
+            if (pConnection != nullptr || !caKey.IsEmpty()) {
+                FetchResult(pConnection, pResult, APollQuery->Data()[_T("UniqueId")], APollQuery->Data()[_T("Action")],
+                            APollQuery->Data()[_T("Payload")], caKey);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::FetchResult(CHTTPServerConnection *AConnection, CPQResult *AResult, const CString &UniqueId,
+                const CString &Action, const CString &Payload, const CString &Key) {
+
+            CWSMessage wsmResponse;
+
+            wsmResponse.MessageTypeId = mtCallResult;
+            wsmResponse.UniqueId = UniqueId;
+            wsmResponse.Action = Action;
+
+            const auto bDataArray = wsmResponse.Action.Find(_T("/list")) != CString::npos;
+
+            // A shared (coalesced or cached) reply is always built as a whole.
+            if (bDataArray && Key.IsEmpty() && StreamResult(AConnection, AResult, UniqueId, Action)) {
+                CallReplied(AConnection, UniqueId, Action);
+                return;
+            }
+
+            CHTTPReply::CStatusType status = CHTTPReply::bad_request;
+
+            CString jsonString;
+
+            try {
+                PQResultToJson(AResult, jsonString, bDataArray ? "array" : "object");
+
+                if (AResult->nTuples() == 1) {
+                    // Only an error or a session change needs the parsed payload, everything else is passed on as text.
+                    const auto bParse = jsonString.Find(_T("\"error\"")) != CString::npos ||
+                            wsmResponse.Action == _T("/api/v1/sign/in") || wsmResponse.Action == _T("/api/v1/sign/out") ||
+                            wsmResponse.Action == _T("/api/v1/authenticate") || wsmResponse.Action == _T("/api/v1/authorize");
+
+                    if (bParse) {
+                        wsmResponse.Payload << jsonString;
+                        wsmResponse.ErrorCode = CheckError(bDataArray ? wsmResponse.Payload[0] : wsmResponse.Payload, wsmResponse.ErrorMessage);
+                    }
+
+                    if (wsmResponse.ErrorCode == 0) {
+                        status = CHTTPReply::unauthorized;
+
+                        // Nothing to update for a coalesced result whose caller has disconnected.
+                        if (AConnection != nullptr) {
+                            if (bParse)
+                                AfterQuery(AConnection, wsmResponse.Action, wsmResponse.Payload);
+
+                            if (IsObserverAction(wsmResponse.Action)) {
+                                UpdateObserver(AConnection, wsmResponse.Action, Payload);
+                            } else if (wsmResponse.Action == _T("/api/v1/sign/in") || wsmResponse.Action == _T("/api/v1/authenticate") ||
+                                       wsmResponse.Action == _T("/api/v1/authorize")) {
+                                auto pSession = m_SessionIndex.FindByConnection(AConnection);
+                                if (wsmResponse.Action == _T("/api/v1/sign/in"))
+                                    m_SessionIndex.Update(pSession); // the session code may have changed
+                                if (pSession != nullptr) {
+                                    m_ObserverIndex.Forget(pSession->Session());
+                                    ObserverDiscovery(pSession);
+                                }
+                            }
+                        }
+                    } else {
+                        wsmResponse.MessageTypeId = mtCallError;
+                    }
+                }
+            } catch (Delphi::Exception::Exception &E) {
+                wsmResponse.MessageTypeId = mtCallError;
+                wsmResponse.ErrorCode = status;
+                wsmResponse.ErrorMessage = E.what();
+
+                Log()->Error(APP_LOG_ERR, 0, "[WebSocketAPI] Error: %s", E.what());
+            }
+
+            if (!Key.IsEmpty())
+                CoalesceReply(Key, wsmResponse, jsonString);
+
+            if (AConnection == nullptr)
+                return;
+
+            CallReplied(AConnection, UniqueId, Action);
+
+            if (wsmResponse.MessageTypeId == mtCallResult) {
+                WriteMessage(AConnection, CallResult(UniqueId, Action, jsonString));
+                return;
+            }
+
+            CString sResponse;
+            CWSProtocol::Response(wsmResponse, sResponse);
+
+            WriteMessage(AConnection, sResponse);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::QuoteJson(std::string &Buffer, const CString &Value) {
+            static const char Hex[] = "0123456789abcdef";
+
+            Buffer.push_back('"');
+            for (size_t i = 0; i < Value.Size(); ++i) {
+                const auto ch = (unsigned char) Value.at(i);
+
+                if (ch == '"' || ch == '\\') {
+                    Buffer.push_back('\\');
+                    Buffer.push_back((char) ch);
+                } else if (ch < 0x20) {
+                    Buffer.append("\\u00");
+                    Buffer.push_back(Hex[ch >> 4]);
+                    Buffer.push_back(Hex[ch & 0x0F]);
+                } else {
+                    Buffer.push_back((char) ch);
+                }
+            }
+            Buffer.push_back('"');
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CWebSocketAPI::CallResult(const CString &UniqueId, const CString &Action, const CString &Payload) {
+            // The payload is already JSON text and is spliced into the envelope as is.
+            std::string Message;
+            Message.reserve(Payload.Size() + UniqueId.Size() + Action.Size() + 32);
+
+            Message.append("{\"t\":");
+            Message.append(std::to_string((int) mtCallResult));
+            Message.append(",\"u\":");
+            QuoteJson(Message, UniqueId);
+            Message.append(",\"a\":");
+            QuoteJson(Message, Action);
+            Message.append(",\"p\":");
+
+            if (Payload.IsEmpty()) {
+                Message.append("null");
+            } else {
+                Message.append(Payload.c_str(), Payload.Size());
+            }
+
+            Message.push_back('}');
+
+            return CString(Message.data(), Message.size());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CWebSocketAPI::StreamResult(CHTTPServerConnection *AConnection, CPQResult *AResult, const CString &UniqueId,
+                const CString &Action) {
+
+            if (AConnection == nullptr || AConnection->ClosedGracefully())
+                return false;
+
+            const auto it = m_Contexts.find(AConnection);
+            if (it == m_Contexts.end() || it->second.Chunk == 0)
+                return false;
+
+            const auto Chunk = (int) it->second.Chunk;
+            const auto Rows = AResult->nTuples();
+
+            // A single row may carry an error. Rows are spliced as is, so only a single json or jsonb column is streamed,
+            // anything else is built by PQResultToJson.
+            if (Rows <= Chunk || AResult->nFields() != 1)
+                return false;
+
+            const auto Type = PQftype(AResult->Handle(), 0);
+            if (Type != WS_OID_JSON && Type != WS_OID_JSONB)
+                return false;
+
+            std::string Header;
+            Header.append("{\"t\":");
+            Header.append(std::to_string((int) mtCallResult));
+            Header.append(",\"u\":");
+            QuoteJson(Header, UniqueId);
+            Header.append(",\"a\":");
+            QuoteJson(Header, Action);
+
+            // The result is kept and parts are built one at a time as the socket drains, so a large list never sits in
+            // the outbound queue as a whole.
+            CWSStream Stream;
+            Stream.Result = PQcopyResult(AResult->Handle(), PG_COPYRES_TUPLES);
+            if (Stream.Result == nullptr)
+                return false;
+
+            Stream.Header = std::move(Header);
+
+            it->second.Streams.push_back(std::move(Stream));
+
+            WriteStream(AConnection);
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::WriteStream(CHTTPServerConnection *AConnection) {
+
+            std::string Message;
+
+            while (!AConnection->ClosedGracefully() && m_Outbound.find(AConnection) == m_Outbound.end() &&
+                   PendingBytes(AConnection) < m_OutboundHighWatermark) {
+
+                const auto it = m_Contexts.find(AConnection);
+                if (it == m_Contexts.end() || it->second.Streams.empty())
+                    return;
+
+                auto &stream = it->second.Streams.front();
+
+                const auto Chunk = (int) it->second.Chunk;
+                const auto Rows = PQntuples(stream.Result);
+                const auto Last = std::min(stream.Row + Chunk, Rows);
+
+                Message.assign(stream.Header);
+                Message.append(",\"s\":");
+                Message.append(std::to_string(stream.Part++));
+                Message.append(Last == Rows ? ",\"f\":true,\"p\":[" : ",\"f\":false,\"p\":[");
+
+                for (int i = stream.Row; i < Last; ++i) {
+                    if (i > stream.Row)
+                        Message.push_back(',');
+                    if (PQgetisnull(stream.Result, i, 0)) {
+                        Message.append("null");
+                    } else {
+                        Message.append(PQgetvalue(stream.Result, i, 0), PQgetlength(stream.Result, i, 0));
+                    }
+                }
+
+                Message.append("]}");
+
+                stream.Row = Last;
+
+                if (Last == Rows) {
+                    PQclear(stream.Result);
+                    it->second.Streams.pop_front();
+                }
+
+                // May close the connection and delete its context.
+                WriteMessage(AConnection, CString(Message.data(), Message.size()));
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::QueryException(CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+
+            auto pConnection = dynamic_cast<CHTTPServerConnection *> (APollQuery->Binding());
+
+            const auto &caKey = APollQuery->Data()[_T("Coalesce")];
+            if (!caKey.IsEmpty())
+                CoalesceError(caKey, APollQuery->Data()[_T("Action")], CHTTPReply::internal_server_error, E.what());
+
+            if (pConnection != nullptr && !pConnection->ClosedGracefully() && APollQuery->Data()[_T("Discovery")].IsEmpty()) {
+                CWSMessage wsmResponse;
+                CString sResponse;
+
+                // The connection may have received other messages since the query was sent.
+                wsmResponse.UniqueId = APollQuery->Data()[_T("UniqueId")];
+                wsmResponse.Action = APollQuery->Data()[_T("Action")];
+
+                wsmResponse.MessageTypeId = mtCallError;
+                wsmResponse.ErrorCode = CHTTPReply::internal_server_error;
+                wsmResponse.ErrorMessage = E.what();
+
+                CallReplied(pConnection, wsmResponse.UniqueId, wsmResponse.Action);
+
+                CWSProtocol::Response(wsmResponse, sResponse);
+
+                WriteMessage(pConnection, sResponse);
+            }
+
+            Log()->Error(APP_LOG_ERR, 0, "[WebSocketAPI] Query exception: %s", E.what());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::DoPostgresQueryException(CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+            QueryException(APollQuery, E);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CWebSocketAPI::PendingBytes(CHTTPServerConnection *AConnection) {
+            return AConnection->OutputBuffer()->Size();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::WriteMessage(CHTTPServerConnection *AConnection, const CString &Message, bool Droppable) {
+
+            if (AConnection == nullptr || AConnection->ClosedGracefully())
+                return;
+
+            auto it = m_Outbound.find(AConnection);
+
+            if (it == m_Outbound.end() && PendingBytes(AConnection) < m_OutboundHighWatermark) {
+                WriteFrame(AConnection, Message, true);
+                return;
+            }
+
+            auto &queue = it == m_Outbound.end() ? m_Outbound[AConnection] : it->second;
+
+            queue.Paused(true);
+            queue.Push(Message, Droppable);
+
+            while (PendingBytes(AConnection) + queue.Size() > m_OutboundLimit) {
+                if (m_OutboundCloseSlow || !queue.DropOldest()) {
+                    auto pSocket = AConnection->Socket()->Binding();
+                    if (pSocket != nullptr) {
+                        Log()->Error(APP_LOG_WARN, 0, "[WebSocketAPI] [%s:%d] Slow consumer: %d bytes pending, closing connection.",
+                                     pSocket->PeerIP(), pSocket->PeerPort(), (int) (PendingBytes(AConnection) + queue.Size()));
+                    }
+
+                    m_Outbound.erase(AConnection);
+
+                    AConnection->SendWebSocketClose();
+                    AConnection->CloseConnection(true);
+                    return;
+                }
+            }
+
+            FlushOutbound(AConnection);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::FlushOutbound(CHTTPServerConnection *AConnection) {
+
+            auto it = m_Outbound.find(AConnection);
+            if (it == m_Outbound.end())
+                return;
+
+            auto &queue = it->second;
+
+            if (AConnection->ClosedGracefully()) {
+                m_Outbound.erase(it);
+                return;
+            }
+
+            if (queue.Paused() && PendingBytes(AConnection) > m_OutboundLowWatermark)
+                return;
+
+            queue.Paused(false);
+
+            // Frames are appended to the output buffer and written out together with the last one.
+            size_t Pending = PendingBytes(AConnection);
+            while (!queue.Empty() && Pending < m_OutboundHighWatermark) {
+                Pending += queue.Front().Size();
+                const auto bLast = queue.Count() == 1 || Pending >= m_OutboundHighWatermark;
+                WriteFrame(AConnection, queue.Front(), bLast);
+                queue.Pop();
+            }
+
+            if (queue.Empty()) {
+                m_Outbound.erase(it);
+            } else {
+                queue.Paused(true);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CWebSocketAPI::WriteShared(CHTTPServerConnection *AConnection, const CString &Frame, size_t Pos,
+                const CString &UniqueId) {
+
+            // Connections that encode their messages or hold a queue take the message the usual way.
+            const auto it = m_Contexts.find(AConnection);
+            if (it != m_Contexts.end() && (it->second.MsgPack || it->second.Deflate))
+                return false;
+
+            if (m_Outbound.find(AConnection) != m_Outbound.end() || PendingBytes(AConnection) >= m_OutboundHighWatermark)
+                return false;
+
+            auto pBuffer = AConnection->OutputBuffer();
+
+            if (Pos == CString::npos) {
+                pBuffer->Write(Frame.c_str(), Frame.Size());
+            } else {
+                pBuffer->Write(Frame.c_str(), Pos);
+                pBuffer->Write(UniqueId.c_str(), UniqueId.Size());
+                pBuffer->Write(Frame.c_str() + Pos + UniqueId.Size(), Frame.Size() - Pos - UniqueId.Size());
+            }
+
+            m_Metrics.Sent(Frame.Size());
+
+            AConnection->WriteAsync();
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::WriteFrame(CHTTPServerConnection *AConnection, const CString &Message, bool SendNow) {
+
+            const auto it = m_Contexts.find(AConnection);
+
+            if (it != m_Contexts.end()) {
+                auto &context = it->second;
+
+                CString Data;
+                if (context.MsgPack && !CMsgPack::Encode(Message, Data))
+                    Data.Clear();
+
+                const auto &Payload = Data.IsEmpty() ? Message : Data;
+
+                CString Frame;
+                if (context.Deflate && Payload.Size() >= m_DeflateThreshold && DeflateFrame(AConnection, context, Payload, Frame)) {
+                    AConnection->OutputBuffer()->Write(Frame.c_str(), Frame.Size());
+                } else if (!Data.IsEmpty()) {
+                    EncodeFrame(WS_OPCODE_BINARY, Data, Frame);
+                    AConnection->OutputBuffer()->Write(Frame.c_str(), Frame.Size());
+                } else {
+                    m_Metrics.Sent(Message.Size());
+                    AConnection->WSReply()->SetPayload(Message);
+                    AConnection->SendWebSocket(SendNow);
+                    return;
+                }
+
+                m_Metrics.Sent(Frame.Size());
+
+                if (SendNow)
+                    AConnection->WriteAsync();
+
+                return;
+            }
+
+            m_Metrics.Sent(Message.Size());
+
+            AConnection->WSReply()->SetPayload(Message);
+            AConnection->SendWebSocket(SendNow);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CWebSocketAPI::DeflateFrame(CHTTPServerConnection *AConnection, CWSContext &Context, const CString &Message,
+                CString &Frame) {
+
+            auto pStream = Context.Deflater != nullptr ? Context.Deflater : m_DeflatePool.Acquire();
+            if (pStream == nullptr)
+                return false;
+
+            CString Data;
+            const auto bSuccess = CDeflatePool::Deflate(pStream, Message, Data);
+
+            if (m_DeflateContextTakeover && bSuccess) {
+                Context.Deflater = pStream;
+            } else {
+                // Without context takeover every message starts from an empty window and the stream goes back to the pool.
+                m_DeflatePool.Release(pStream);
+                Context.Deflater = nullptr;
+            }
+
+            if (!bSuccess)
+                return false;
+
+            EncodeFrame(WS_OPCODE_BINARY, Data, Frame);
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CWebSocketAPI::InflateRequest(CHTTPServerConnection *AConnection, const CString &Request, CString &Result) {
+
+            const auto it = m_Contexts.find(AConnection);
+            if (it == m_Contexts.end() || !it->second.Deflate)
+                return false;
+
+            auto &Context = it->second;
+
+            if (Context.Inflater == nullptr)
+                Context.Inflater = CDeflatePool::NewInflate();
+
+            return Context.Inflater != nullptr && CDeflatePool::Inflate(Context.Inflater, Request, Result, m_MaxMessageSize);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::InflateFailed(CHTTPServerConnection *AConnection) {
+
+            auto pSocket = AConnection->Socket()->Binding();
+            if (pSocket != nullptr) {
+                Log()->Error(APP_LOG_WARN, 0, "[WebSocketAPI] [%s:%d] Compressed message is invalid or larger than %d bytes, closing connection.",
+                             pSocket->PeerIP(), pSocket->PeerPort(), (int) m_MaxMessageSize);
+            }
+
+            // The inflate stream is out of sync with the client after a failure, the connection cannot be reused.
+            AConnection->SendWebSocketClose();
+            AConnection->CloseConnection(true);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CWebSocketAPI::IsDeflate(CHTTPServerConnection *AConnection) const {
+            const auto it = m_Contexts.find(AConnection);
+            return it != m_Contexts.end() && it->second.Deflate;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CWebSocketAPI::IsMsgPack(CHTTPServerConnection *AConnection) const {
+            const auto it = m_Contexts.find(AConnection);
+            return it != m_Contexts.end() && it->second.MsgPack;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CWebSocketAPI::SessionSignature(CHTTPServerConnection *AConnection, const CString &Secret, const CString &Data) {
+
+            auto &context = m_Contexts[AConnection];
+
+            // The key is set once per secret, each message works on a copy of the keyed context.
+            if (context.Hmac == nullptr || context.HmacKey != Secret) {
+                if (context.Hmac != nullptr) {
+                    EVP_MAC_CTX_free(context.Hmac);
+                    context.Hmac = nullptr;
+                }
+
+                context.HmacKey.Clear();
+
+                auto pMac = EVP_MAC_fetch(nullptr, "HMAC", nullptr);
+                if (pMac == nullptr)
+                    return hmac_sha256(Secret, Data);
+
+                context.Hmac = EVP_MAC_CTX_new(pMac);
+                EVP_MAC_free(pMac);
+
+                char szDigest[] = "SHA256";
+                const OSSL_PARAM Params[] = {
+                    OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, szDigest, 0),
+                    OSSL_PARAM_construct_end()
+                };
+
+                if (context.Hmac == nullptr || EVP_MAC_init(context.Hmac, (const unsigned char *) Secret.c_str(), Secret.Size(), Params) != 1) {
+                    EVP_MAC_CTX_free(context.Hmac);
+                    context.Hmac = nullptr;
+                    return hmac_sha256(Secret, Data);
+                }
+
+                context.HmacKey = Secret;
+            }
+
+            auto pMessage = EVP_MAC_CTX_dup(context.Hmac);
+            if (pMessage == nullptr)
+                return hmac_sha256(Secret, Data);
+
+            unsigned char Digest[EVP_MAX_MD_SIZE];
+            size_t Length = 0;
+
+            const auto bSigned = EVP_MAC_update(pMessage, (const unsigned char *) Data.c_str(), Data.Size()) == 1 &&
+                                 EVP_MAC_final(pMessage, Digest, &Length, sizeof(Digest)) == 1;
+
+            EVP_MAC_CTX_free(pMessage);
+
+            if (!bSigned)
+                return hmac_sha256(Secret, Data);
+
+            static const char Hex[] = "0123456789abcdef";
+
+            std::string Result;
+            Result.reserve(Length * 2);
+            for (size_t i = 0; i < Length; ++i) {
+                Result.push_back(Hex[Digest[i] >> 4]);
+                Result.push_back(Hex[Digest[i] & 0x0F]);
+            }
+
+            return Result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::DeleteContext(CHTTPServerConnection *AConnection) {
+
+            const auto it = m_Contexts.find(AConnection);
+            if (it == m_Contexts.end())
+                return;
+
+            m_DeflatePool.Release(it->second.Deflater);
+            CDeflatePool::FreeInflate(it->second.Inflater);
+
+            EVP_MAC_CTX_free(it->second.Hmac);
+
+            for (const auto &stream : it->second.Streams)
+                PQclear(stream.Result);
+
+            m_Contexts.erase(it);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::EncodeFrame(unsigned char Opcode, const CString &Payload, CString &Frame) {
+            std::string Buffer;
+
+            const auto Length = (uint64_t) Payload.Size();
+
+            Buffer.push_back((char) (0x80 | Opcode)); // FIN
+
+            if (Length < 126) {
+                Buffer.push_back((char) Length);
+            } else if (Length <= 0xFFFF) {
+                Buffer.push_back((char) 126);
+                Buffer.push_back((char) ((Length >> 8) & 0xFF));
+                Buffer.push_back((char) (Length & 0xFF));
+            } else {
+                Buffer.push_back((char) 127);
+                for (int i = 7; i >= 0; --i)
+                    Buffer.push_back((char) ((Length >> (i * 8)) & 0xFF));
+            }
+
+            Buffer.append(Payload.c_str(), Payload.Size());
+
+            Frame = CString(Buffer.data(), Buffer.size());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CWebSocketAPI::StatementSQL(const CString &Statement, const CStringList &Params, int Attempt) {
+
+            // Queries use $n placeholders, they are prepared as is or filled in with quoted literals.
+            static const std::unordered_map<std::string, std::string> Statements = {
+                {"ws_unauthorized_fetch", "SELECT * FROM daemon.unauthorized_fetch('POST', $1, $2::jsonb, $3, $4)"},
+                {"ws_fetch", "SELECT * FROM daemon.fetch($1, 'POST', $2, $3::jsonb, $4, $5)"},
+                {"ws_session_fetch", "SELECT * FROM daemon.session_fetch($1, $2, 'POST', $3, $4::jsonb, $5, $6)"},
+                {"ws_authorized_fetch", "SELECT * FROM daemon.authorized_fetch($1, $2, 'POST', $3, $4::jsonb, $5, $6)"},
+                {"ws_signed_fetch", "SELECT * FROM daemon.signed_fetch('POST', $1, $2::json, $3, $4, $5, $6, $7, $8::interval)"},
+                {"ws_observer", "SELECT * FROM daemon.observer($1, $2, $3, $4::jsonb, $5, $6)"}
+            };
+
+            const auto &caQuery = Statements.at(Statement.c_str());
+
+            std::string SQL;
+
+            size_t Size = caQuery.size() * 2 + 32;
+            for (int i = 0; i < Params.Count(); ++i)
+                Size += Params[i].Size() + 2;
+            SQL.reserve(Size);
+
+            const auto Append = [&SQL](const CString &Value) {
+                SQL.append(Value.c_str(), Value.Size());
+            };
+
+            if (Attempt < 2) {
+                if (Attempt == 1) {
+                    SQL.append("PREPARE ");
+                    Append(Statement);
+                    SQL.append(" AS ");
+                    SQL.append(caQuery);
+                    SQL.append(";\n");
+                }
+
+                SQL.append("EXECUTE ");
+                Append(Statement);
+                SQL.push_back('(');
+                for (int i = 0; i < Params.Count(); ++i) {
+                    if (i > 0)
+                        SQL.append(", ");
+                    Append(Params[i]);
+                }
+                SQL.append(");");
+
+                return CString(SQL.data(), SQL.size());
+            }
+
+            size_t Pos = 0;
+            while (Pos < caQuery.size()) {
+                const auto Next = caQuery.find('$', Pos);
+                if (Next == std::string::npos) {
+                    SQL.append(caQuery, Pos, std::string::npos);
+                    break;
+                }
+
+                SQL.append(caQuery, Pos, Next - Pos);
+
+                size_t Last = Next + 1;
+                int Index = 0;
+                while (Last < caQuery.size() && isdigit((unsigned char) caQuery[Last]))
+                    Index = Index * 10 + (caQuery[Last++] - '0');
+
+                Append(Params[Index - 1]);
+
+                Pos = Last;
+            }
+
+            SQL.push_back(';');
+
+            return CString(SQL.data(), SQL.size());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CWebSocketAPI::CanLaunch(CQueryClass Class) const {
+
+            size_t Running = 0;
+            size_t Reserved = 0;
+            size_t Shared = 0;
+
+            for (int i = 0; i < qcCount; ++i) {
+                Running += m_Running[i];
+                Reserved += m_Reserve[i];
+                if (m_Running[i] > m_Reserve[i])
+                    Shared += m_Running[i] - m_Reserve[i];
+            }
+
+            if (Running >= m_SchedulerSlots)
+                return false;
+
+            // A class always gets its reserved slots, the rest of the pool is shared.
+            return m_Running[Class] < m_Reserve[Class] || Reserved + Shared < m_SchedulerSlots;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CStringList *CWebSocketAPI::Launch(CQueryClass Class, CWSJob &Job) {
+
+            const auto &OnExecuted = Job.OnExecuted;
+            const auto &OnException = Job.OnException;
+
+            auto OnDone = [this, Class, OnExecuted](CPQPollQuery *APollQuery) {
+                m_Running[Class]--;
+                OnExecuted(APollQuery);
+                Dispatch();
+            };
+
+            auto OnFail = [this, Class, OnException](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                m_Running[Class]--;
+                OnException(APollQuery, E);
+                Dispatch();
+            };
+
+            auto pQuery = ExecSQL(Job.SQL, Job.Binding, OnDone, OnFail);
+            m_Running[Class]++;
+
+            pQuery->Data() = Job.Data;
+
+            return &pQuery->Data();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CStringList *CWebSocketAPI::Schedule(CQueryClass Class, const CStringList &SQL, CPollConnection *ABinding,
+                COnApostolModuleSuccessEvent OnExecuted, COnApostolModuleFailEvent OnException) {
+
+            if (m_SchedulerSlots == 0) {
+                auto pQuery = ExecSQL(SQL, ABinding, std::move(OnExecuted), std::move(OnException));
+                return &pQuery->Data();
+            }
+
+            CWSJob Job = {SQL, CStringList(), ABinding, std::move(OnExecuted), std::move(OnException)};
+
+            if (m_Jobs[Class].empty() && CanLaunch(Class))
+                return Launch(Class, Job);
+
+            // Queued: the caller fills in the data, it is copied to the query when the job is launched.
+            m_Jobs[Class].push_back(std::move(Job));
+
+            return &m_Jobs[Class].back().Data;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::Dispatch() {
+
+            if (m_SchedulerSlots == 0)
+                return;
+
+            while (true) {
+                int Class = -1;
+
+                // Reserved slots first, then smooth weighted round robin over the shared ones.
+                for (int i = 0; i < qcCount && Class == -1; ++i) {
+                    if (!m_Jobs[i].empty() && m_Running[i] < m_Reserve[i])
+                        Class = i;
+                }
+
+                if (Class == -1) {
+                    int Total = 0;
+                    for (int i = 0; i < qcCount; ++i) {
+                        if (m_Jobs[i].empty() || !CanLaunch((CQueryClass) i))
+                            continue;
+
+                        m_Credit[i] += m_Weight[i];
+                        Total += m_Weight[i];
+
+                        if (Class == -1 || m_Credit[i] > m_Credit[Class])
+                            Class = i;
+                    }
+
+                    if (Class == -1)
+                        break;
+
+                    m_Credit[Class] -= Total;
+                }
+
+                auto &Jobs = m_Jobs[Class];
+
+                try {
+                    Launch((CQueryClass) Class, Jobs.front());
+                } catch (Delphi::Exception::Exception &E) {
+                    // Left in the queue and retried on the next completion or heartbeat.
+                    DoError(E);
+                    break;
+                }
+
+                Jobs.pop_front();
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CStringList *CWebSocketAPI::ExecPrepared(CQueryClass Class, const CString &Statement, const CStringList &Params,
+                CPollConnection *AConnection, COnApostolModuleSuccessEvent OnExecuted, COnApostolModuleFailEvent OnException,
+                int Attempt) {
+
+            // Attempts: 0 - EXECUTE, 1 - PREPARE and EXECUTE, 2 - plain query text. The pool picks the backend when the
+            // query is sent, so whether it has the statement is only learnt from the error.
+            if (!m_PreparedStatements)
+                Attempt = 2;
+
+            auto OnPrepared = [this, Class, Statement, Params, OnExecuted, OnException, Attempt](CPQPollQuery *APollQuery) {
+
+                auto pResult = APollQuery->Results(APollQuery->ResultCount() - 1);
+
+                if (pResult->ExecStatus() != PGRES_TUPLES_OK && Attempt < 2) {
+                    const auto szState = PQresultErrorField(pResult->Handle(), PG_DIAG_SQLSTATE);
+                    const CString caState(szState == nullptr ? "" : szState);
+
+                    // The pool may hand the query to a backend that has not prepared the statement yet (26000),
+                    // or that prepared it after all (42P05): try again, the last attempt does not depend on it.
+                    if (caState == "26000" || caState == "42P05") {
+                        try {
+                            auto pData = ExecPrepared(Class, Statement, Params, dynamic_cast<CPollConnection *> (APollQuery->Binding()),
+                                                      OnExecuted, OnException, caState == "26000" ? Attempt + 1 : 2);
+                            *pData = APollQuery->Data();
+                        } catch (Delphi::Exception::Exception &E) {
+                            OnException(APollQuery, E);
+                        }
+                        return;
+                    }
+                }
+
+                OnExecuted(APollQuery);
+            };
+
+            CStringList SQL;
+            SQL.Add(StatementSQL(Statement, Params, Attempt));
+
+            return Schedule(Class, SQL, AConnection, OnPrepared, std::move(OnException));
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CQueryClass CWebSocketAPI::CallClass(const CString &Action) {
+            return Action == _T("/api/v1/authenticate") || Action == _T("/api/v1/authorize") ||
+                   Action.SubString(0, 13) == _T("/api/v1/sign/") ? qcAuth : qcInteractive;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CStringList *CWebSocketAPI::ExecFetch(CHTTPServerConnection *AConnection, const CString &Statement, const CStringList &Params,
+                const CString &UniqueId, const CString &Action, const CString &Payload) {
+
+            if (m_Collector != nullptr) {
+                // On the second attempt the first call of each statement is preceded by its PREPARE and its result.
+                auto Attempt = m_PreparedStatements ? m_Collector->Attempt : 2;
+                if (Attempt == 1) {
+                    if (m_Collector->Prepared.IndexOf(Statement) == -1) {
+                        m_Collector->Prepared.Add(Statement);
+                    } else {
+                        Attempt = 0;
+                    }
+                }
+
+                m_Collector->SQL.Add(StatementSQL(Statement, Params, Attempt));
+                m_Collector->Results.push_back((m_Collector->Results.empty() ? 0 : m_Collector->Results.back() + 1) + (Attempt == 1 ? 1 : 0));
+                return nullptr;
+            }
+
+            try {
+                const auto Started = std::chrono::steady_clock::now();
+
+                // Only client calls that passed AdmitCall count towards max_in_flight, see PipelineFetch.
+                auto OnExecuted = [this, Statement, Started](CPQPollQuery *APollQuery) {
+                    if (APollQuery->Data()[_T("Admitted")] == _T("true"))
+                        CallFinished();
+                    m_Metrics.Query(Statement, std::chrono::duration<double>(std::chrono::steady_clock::now() - Started).count());
+                    DoPostgresQueryExecuted(APollQuery);
+                };
+
+                auto OnException = [this, Statement, Started](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                    if (APollQuery->Data()[_T("Admitted")] == _T("true"))
+                        CallFinished();
+                    m_Metrics.Query(Statement, std::chrono::duration<double>(std::chrono::steady_clock::now() - Started).count());
+                    DoPostgresQueryException(APollQuery, E);
+                };
+
+                const auto Class = Statement == "ws_unauthorized_fetch" ? qcAuth : CallClass(Action);
+
+                auto pData = ExecPrepared(Class, Statement, Params, AConnection, OnExecuted, OnException);
+
+                pData->Values(_T("UniqueId"), UniqueId);
+                pData->Values(_T("Action"), Action);
+                if (IsObserverAction(Action))
+                    pData->Values(_T("Payload"), Payload);
+                return pData;
+            } catch (Delphi::Exception::Exception &E) {
+                DoError(AConnection, UniqueId, Action, CHTTPReply::service_unavailable, E);
+            }
+
+            return nullptr;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CStringList *CWebSocketAPI::UnauthorizedFetch(CHTTPServerConnection *AConnection, const CString &UniqueId,
+                const CString &Action, const CString &Payload, const CString &Agent, const CString &Host) {
+
+            CStringList Params;
+
+            Params.Add(PQQuoteLiteral(Action));
+            Params.Add(Payload.IsEmpty() ? "null" : PQQuoteLiteral(Payload));
+            Params.Add(PQQuoteLiteral(Agent));
+            Params.Add(PQQuoteLiteral(Host));
+
+            AConnection->Data().Values("authorized", "false");
+            AConnection->Data().Values("signature", "false");
+
+            return ExecFetch(AConnection, "ws_unauthorized_fetch", Params, UniqueId, Action, Payload);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CStringList *CWebSocketAPI::AuthorizedFetch(CHTTPServerConnection *AConnection, const CAuthorization &Authorization,
+                const CString &UniqueId, const CString &Action, const CString &Payload, const CString &Agent, const CString &Host) {
+
+            CStringList Params;
+            CString Statement;
+
+            if (Authorization.Schema == CAuthorization::asBearer) {
+
+                Statement = "ws_fetch";
+
+                Params.Add(PQQuoteLiteral(Authorization.Token));
+
+            } else if (Authorization.Schema == CAuthorization::asBasic) {
+
+                Statement = Authorization.Type == CAuthorization::atSession ? "ws_session_fetch" : "ws_authorized_fetch";
+
+                Params.Add(PQQuoteLiteral(Authorization.Username));
+                Params.Add(PQQuoteLiteral(Authorization.Password));
+
+            } else {
+
+                return UnauthorizedFetch(AConnection, UniqueId, Action, Payload, Agent, Host);
+
+            }
+
+            Params.Add(PQQuoteLiteral(Action));
+            Params.Add(Payload.IsEmpty() ? "null" : PQQuoteLiteral(Payload));
+            Params.Add(PQQuoteLiteral(Agent));
+            Params.Add(PQQuoteLiteral(Host));
+
+            AConnection->Data().Values("authorized", "true");
+            AConnection->Data().Values("signature", "false");
+
+            return ExecFetch(AConnection, Statement, Params, UniqueId, Action, Payload);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CStringList *CWebSocketAPI::PreSignedFetch(CHTTPServerConnection *AConnection, const CString &UniqueId,
+                const CString &Action, const CString &Payload, CSession *ASession) {
+
+            if (m_TrustedSecret && !ASession->Secret().IsEmpty()) {
+                // The secret was accepted by daemon.authenticate for this session, the database only has to match it.
+                CAuthorization Authorization;
+
+                Authorization.Schema = CAuthorization::asBasic;
+                Authorization.Type = CAuthorization::atSession;
+                Authorization.Username = ASession->Session();
+                Authorization.Password = ASession->Secret();
+
+                return AuthorizedFetch(AConnection, Authorization, UniqueId, Action, Payload, ASession->Agent(), ASession->IP());
+            }
+
+            CString sData;
+
+            const auto& caNonce = LongToString(MsEpoch() * 1000);
+
+            sData = Action;
+            sData << caNonce;
+            sData << (Payload.IsEmpty() ? _T("null") : Payload);
+
+            const auto& caSignature = ASession->Secret().IsEmpty() ? _T("") : SessionSignature(AConnection, ASession->Secret(), sData);
+
+            return SignedFetch(AConnection, UniqueId, Action, Payload, ASession->Session(), caNonce, caSignature, ASession->Agent(), ASession->IP());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CStringList *CWebSocketAPI::SessionFetch(CHTTPServerConnection *AConnection, const CString &UniqueId,
+                const CString &Action, const CString &Payload, CSession *ASession) {
+
+            const auto& caAuthorization = ASession->Authorization();
+
+            if (caAuthorization.Schema != CAuthorization::asUnknown)
+                return AuthorizedFetch(AConnection, caAuthorization, UniqueId, Action, Payload, ASession->Agent(), ASession->IP());
+
+            return PreSignedFetch(AConnection, UniqueId, Action, Payload, ASession);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CStringList *CWebSocketAPI::SignedFetch(CHTTPServerConnection *AConnection, const CString &UniqueId,
+                const CString &Action, const CString &Payload, const CString &Session, const CString &Nonce,
+                const CString &Signature, const CString &Agent, const CString &Host, long int ReceiveWindow) {
+
+            CStringList Params;
+
+            Params.Add(PQQuoteLiteral(Action));
+            Params.Add(Payload.IsEmpty() ? "null" : PQQuoteLiteral(Payload));
+            Params.Add(PQQuoteLiteral(Session));
+            Params.Add(PQQuoteLiteral(Nonce));
+            Params.Add(PQQuoteLiteral(Signature));
+            Params.Add(PQQuoteLiteral(Agent));
+            Params.Add(PQQuoteLiteral(Host));
+            Params.Add(CString().Format("'%ld milliseconds'", ReceiveWindow));
+
+            AConnection->Data().Values("authorized", "true");
+            AConnection->Data().Values("signature", "true");
+
+            return ExecFetch(AConnection, "ws_signed_fetch", Params, UniqueId, Action, Payload);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::PipelineFetch(CHTTPServerConnection *AConnection, const CString &UniqueId, const CString &Action,
+                const CString &Payload, CSession *ASession, const CString &Key) {
+
+            if (!m_Pipeline) {
+                auto pData = SessionFetch(AConnection, UniqueId, Action, Payload, ASession);
+                if (pData != nullptr) {
+                    pData->Values(_T("Admitted"), _T("true"));
+                    m_InFlightCalls++;
+                    if (!Key.IsEmpty())
+                        pData->Values(_T("Coalesce"), Key);
+                } else if (!Key.IsEmpty()) {
+                    CoalesceError(Key, Action, CHTTPReply::service_unavailable, _T("Service unavailable."));
+                }
+                return;
+            }
+
+            auto &context = m_Contexts[AConnection];
+
+            context.Pending.push_back({UniqueId, Action, Payload, Key});
+
+            if (!context.Busy)
+                PipelineNext(AConnection);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::PipelineNext(CHTTPServerConnection *AConnection) {
+
+            const auto it = m_Contexts.find(AConnection);
+            if (it == m_Contexts.end())
+                return;
+
+            auto &context = it->second;
+
+            context.Busy = false;
+
+            if (context.Pending.empty())
+                return;
+
+            auto pSession = m_SessionIndex.FindByConnection(AConnection);
+            if (pSession == nullptr) {
+                const auto Pending = std::move(context.Pending);
+                context.Pending.clear();
+                for (const auto &fetch : Pending) {
+                    if (!fetch.Key.IsEmpty())
+                        CoalesceHandOff(fetch);
+                }
+                return;
+            }
+
+            // Read-only calls that arrived while the previous batch was running go to the database in one round trip. The
+            // batch is one implicit transaction, so any other call is sent on its own. A batch holds calls of one
+            // scheduler class; after a failed batch its calls are run one at a time, in order.
+            const auto Class = CallClass(context.Pending.front().Action);
+            const auto Depth = context.Isolated > 0 || !MatchAction(m_ReadOnlyActions, context.Pending.front().Action) ? 1 : m_PipelineDepth;
+
+            std::vector<CWSFetch> Batch;
+            do {
+                Batch.push_back(std::move(context.Pending.front()));
+                context.Pending.pop_front();
+            } while (!context.Pending.empty() && Batch.size() < Depth && CallClass(context.Pending.front().Action) == Class &&
+                     MatchAction(m_ReadOnlyActions, context.Pending.front().Action));
+
+            if (context.Isolated > 0)
+                context.Isolated--;
+
+            PipelineBatch(AConnection, pSession, Class, Batch, m_PreparedStatements ? 0 : 2);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::PipelineBatch(CHTTPServerConnection *AConnection, CSession *ASession, CQueryClass Class,
+                const std::vector<CWSFetch> &Batch, int Attempt) {
+
+            CWSBatch Collector;
+            Collector.Attempt = Attempt;
+
+            m_Collector = &Collector;
+            for (const auto &fetch : Batch)
+                SessionFetch(AConnection, fetch.UniqueId, fetch.Action, fetch.Payload, ASession);
+            m_Collector = nullptr;
+
+            const auto &Results = Collector.Results;
+            const auto Started = std::chrono::steady_clock::now();
+
+            auto OnExecuted = [this, Class, Batch, Results, Attempt, Started](CPQPollQuery *APollQuery) {
+
+                CallFinished();
+                m_Metrics.Query(_T("pipeline"), std::chrono::duration<double>(std::chrono::steady_clock::now() - Started).count());
+
+                auto pConnection = dynamic_cast<CHTTPServerConnection *> (APollQuery->Binding());
+
+                if (pConnection != nullptr && pConnection->ClosedGracefully())
+                    pConnection = nullptr;
+
+                bool bFailed = Results.size() != Batch.size() || APollQuery->ResultCount() != Results.back() + 1;
+                for (size_t i = 0; !bFailed && i < Results.size(); ++i)
+                    bFailed = APollQuery->Results(Results[i])->ExecStatus() != PGRES_TUPLES_OK;
+
+                if (bFailed) {
+                    auto pResult = APollQuery->Results(APollQuery->ResultCount() - 1);
+                    auto pSession = pConnection == nullptr ? nullptr : m_SessionIndex.FindByConnection(pConnection);
+
+                    const auto szState = PQresultErrorField(pResult->Handle(), PG_DIAG_SQLSTATE);
+                    const CString caState(szState == nullptr ? "" : szState);
+
+                    const auto bPrepare = Attempt < 2 && (caState == "26000" || caState == "42P05");
+
+                    if (pSession != nullptr && bPrepare) {
+                        // The same steps as in ExecPrepared: prepare the statements in the batch, then send plain queries.
+                        PipelineBatch(pConnection, pSession, Class, Batch, caState == "26000" ? Attempt + 1 : 2);
+                        return;
+                    }
+
+                    if (pSession != nullptr && Batch.size() > 1) {
+                        // The statements share one implicit transaction: nothing was applied, the calls go back to the queue.
+                        auto &context = m_Contexts[pConnection];
+                        for (auto it = Batch.rbegin(); it != Batch.rend(); ++it)
+                            context.Pending.push_front(*it);
+                        context.Isolated += Batch.size();
+                    } else if (pSession == nullptr && (bPrepare || Batch.size() > 1)) {
+                        // Nothing was applied and the caller has gone: coalesced calls are run again for their waiters.
+                        for (const auto &fetch : Batch) {
+                            if (!fetch.Key.IsEmpty())
+                                CoalesceHandOff(fetch);
+                        }
+                    } else {
+                        const Delphi::Exception::EDBError E(pResult->GetErrorMessage());
+                        for (const auto &fetch : Batch) {
+                            if (!fetch.Key.IsEmpty())
+                                CoalesceError(fetch.Key, fetch.Action, CHTTPReply::internal_server_error, E.what());
+                            if (pConnection != nullptr)
+                                DoError(pConnection, fetch.UniqueId, fetch.Action, CHTTPReply::internal_server_error, E);
+                        }
+                    }
+                } else {
+                    for (size_t i = 0; i < Batch.size(); ++i) {
+                        if (pConnection != nullptr || !Batch[i].Key.IsEmpty())
+                            FetchResult(pConnection, APollQuery->Results(Results[i]), Batch[i].UniqueId, Batch[i].Action, Batch[i].Payload, Batch[i].Key);
+                    }
+                }
+
+                if (pConnection != nullptr)
+                    PipelineNext(pConnection);
+            };
+
+            auto OnException = [this, Batch, Started](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+
+                CallFinished();
+                m_Metrics.Query(_T("pipeline"), std::chrono::duration<double>(std::chrono::steady_clock::now() - Started).count());
+
+                for (const auto &fetch : Batch) {
+                    if (!fetch.Key.IsEmpty())
+                        CoalesceError(fetch.Key, fetch.Action, CHTTPReply::internal_server_error, E.what());
+                }
+
+                auto pConnection = dynamic_cast<CHTTPServerConnection *> (APollQuery->Binding());
+
+                if (pConnection == nullptr || pConnection->ClosedGracefully())
+                    return;
+
+                for (const auto &fetch : Batch)
+                    DoError(pConnection, fetch.UniqueId, fetch.Action, CHTTPReply::internal_server_error, E);
+
+                PipelineNext(pConnection);
+            };
+
+            auto &context = m_Contexts[AConnection];
+
+            try {
+                Schedule(Class, Collector.SQL, AConnection, OnExecuted, OnException);
+                context.Busy = true;
+                m_InFlightCalls++;
+            } catch (Delphi::Exception::Exception &E) {
+                context.Busy = false;
+                for (const auto &fetch : Batch) {
+                    if (!fetch.Key.IsEmpty())
+                        CoalesceError(fetch.Key, fetch.Action, CHTTPReply::service_unavailable, E.what());
+                    DoError(AConnection, fetch.UniqueId, fetch.Action, CHTTPReply::service_unavailable, E);
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CWebSocketAPI::MatchAction(const CStringList &Patterns, const CString &Action) {
+            for (int i = 0; i < Patterns.Count(); ++i) {
+                const auto &caPattern = Patterns[i];
+                const auto Pos = caPattern.Find('*');
+
+                if (Pos == CString::npos) {
+                    if (caPattern == Action)
+                        return true;
+                    continue;
+                }
+
+                // One "*" matches any part of the action: /api/v1/*/list.
+                const auto &caPrefix = caPattern.SubString(0, Pos);
+                const auto &caSuffix = caPattern.SubString(Pos + 1);
+
+                if (Action.Size() >= caPrefix.Size() + caSuffix.Size() && Action.SubString(0, caPrefix.Size()) == caPrefix &&
+                        Action.SubString(Action.Size() - caSuffix.Size()) == caSuffix)
+                    return true;
+            }
+
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        CString CWebSocketAPI::CanonicalPayload(const CString &Payload) {
+            // Only insignificant whitespace is removed, key order is left to the client.
+            std::string Result;
+            Result.reserve(Payload.Size());
+
+            bool bString = false;
+            for (size_t i = 0; i < Payload.Size(); ++i) {
+                const auto ch = Payload.at(i);
+
+                if (bString) {
+                    Result.push_back(ch);
+                    if (ch == '\\' && i + 1 < Payload.Size()) {
+                        Result.push_back(Payload.at(++i));
+                    } else if (ch == '"') {
+                        bString = false;
+                    }
+                } else if (ch == '"') {
+                    bString = true;
+                    Result.push_back(ch);
+                } else if (!isspace((unsigned char) ch)) {
+                    Result.push_back(ch);
+                }
+            }
+
+            return Result.empty() ? CString("null") : CString(Result.data(), Result.size());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CWebSocketAPI::RateLimited(CHTTPServerConnection *AConnection, CSession *ASession) {
+
+            if (m_RateLimit <= 0)
+                return false;
+
+            // All connections of an authorized session and identity share one bucket. Before authorization the session
+            // code comes from the URL the client chose, so such calls are limited per connection.
+            std::string Key;
+            if (ASession != nullptr && ASession->Authorized()) {
+                Key.append(ASession->Session().c_str(), ASession->Session().Size());
+                Key.push_back(' ');
+                Key.append(ASession->Identity().c_str(), ASession->Identity().Size());
+            } else {
+                Key = "#" + std::to_string((uintptr_t) AConnection);
+            }
+
+            auto &bucket = m_RateBuckets[Key];
+
+            const auto now = std::chrono::steady_clock::now();
+
+            if (bucket.Tokens < 0) {
+                bucket.Tokens = m_RateBurst;
+            } else {
+                const std::chrono::duration<double> Elapsed = now - bucket.Refill;
+                bucket.Tokens = std::min(m_RateBurst, bucket.Tokens + Elapsed.count() * m_RateLimit);
+            }
+
+            bucket.Refill = now;
+
+            if (bucket.Tokens < 1)
+                return true;
+
+            bucket.Tokens -= 1;
+
+            return false;
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-                CString sResponse;
-                CWSProtocol::Response(wsmResponse, sResponse);
+        void CWebSocketAPI::RefillBuckets() {
+            const auto now = std::chrono::steady_clock::now();
 
-                pWSReply->SetPayload(sResponse);
-                pConnection->SendWebSocket(true);
+            // A bucket that has refilled is the same as a new one.
+            for (auto it = m_RateBuckets.begin(); it != m_RateBuckets.end();) {
+                const std::chrono::duration<double> Elapsed = now - it->second.Refill;
+                if (it->second.Tokens + Elapsed.count() * m_RateLimit >= m_RateBurst) {
+                    it = m_RateBuckets.erase(it);
+                } else {
+                    ++it;
+                }
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CWebSocketAPI::QueryException(CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
-
-            auto pConnection = dynamic_cast<CHTTPServerConnection *> (APollQuery->Binding());
+        void CWebSocketAPI::AdmitCall(CHTTPServerConnection *AConnection, const CString &UniqueId, const CString &Action,
+                const CString &Payload, CSession *ASession) {
 
-            if (pConnection != nullptr && !pConnection->ClosedGracefully()) {
-                auto pWSRequest = pConnection->WSRequest();
-                auto pWSReply = pConnection->WSReply();
+            if (RateLimited(AConnection, ASession))
+                throw CTooManyRequests(_T("Too many requests."));
 
-                const CString csRequest(pWSRequest->Payload());
+            // The queue keeps the arrival order: a new call waits while older ones are still queued.
+            if (m_MaxInFlight != 0 && (m_InFlightCalls >= m_MaxInFlight || !m_Admission.empty())) {
+                if (m_Admission.size() >= m_AdmissionLimit)
+                    throw CTooManyRequests(_T("Too many requests."));
 
-                CWSMessage wsmRequest;
-                CWSProtocol::Request(csRequest, wsmRequest);
+                m_Admission.push_back({AConnection, {UniqueId, Action, Payload}});
+                return;
+            }
 
-                CWSMessage wsmResponse;
-                CString sResponse;
+            CoalescedFetch(AConnection, UniqueId, Action, Payload, ASession);
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-                CWSProtocol::PrepareResponse(wsmRequest, wsmResponse);
+        void CWebSocketAPI::CallFinished() {
 
-                wsmResponse.MessageTypeId = mtCallError;
-                wsmResponse.ErrorCode = CHTTPReply::internal_server_error;
-                wsmResponse.ErrorMessage = E.what();
+            if (m_InFlightCalls > 0)
+                m_InFlightCalls--;
 
-                CWSProtocol::Response(wsmResponse, sResponse);
+            while (!m_Admission.empty() && (m_MaxInFlight == 0 || m_InFlightCalls < m_MaxInFlight)) {
+                const auto call = std::move(m_Admission.front());
+                m_Admission.pop_front();
 
-                pWSReply->SetPayload(sResponse);
-                pConnection->SendWebSocket(true);
+                auto pSession = m_SessionIndex.FindByConnection(call.Connection);
+                if (pSession != nullptr)
+                    CoalescedFetch(call.Connection, call.Fetch.UniqueId, call.Fetch.Action, call.Fetch.Payload, pSession);
             }
-
-            Log()->Error(APP_LOG_ERR, 0, "[WebSocketAPI] Query exception: %s", E.what());
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CWebSocketAPI::DoPostgresQueryException(CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
-            QueryException(APollQuery, E);
-        }
-        //--------------------------------------------------------------------------------------------------------------
+        void CWebSocketAPI::CoalescedFetch(CHTTPServerConnection *AConnection, const CString &UniqueId, const CString &Action,
+                const CString &Payload, CSession *ASession) {
 
-        void CWebSocketAPI::UnauthorizedFetch(CHTTPServerConnection *AConnection, const CString &UniqueId,
-                const CString &Action, const CString &Payload, const CString &Agent, const CString &Host) {
+            const auto bCached = m_CacheActions.Count() != 0 && MatchAction(m_CacheActions, Action);
 
-            CStringList SQL;
+            if (!bCached && (m_ReadOnlyActions.Count() == 0 || !MatchAction(m_ReadOnlyActions, Action))) {
+                PipelineFetch(AConnection, UniqueId, Action, Payload, ASession);
+                return;
+            }
 
-            const auto &caPayload = Payload.IsEmpty() ? "null" : PQQuoteLiteral(Payload);
+            CString Key;
 
-            SQL.Add(CString()
-                            .MaxFormatSize(256 + Action.Size() + caPayload.Size() + Agent.Size())
-                            .Format("SELECT * FROM daemon.unauthorized_fetch('POST', %s, %s::jsonb, %s, %s);",
-                                    PQQuoteLiteral(Action).c_str(),
-                                    caPayload.c_str(),
-                                    PQQuoteLiteral(Agent).c_str(),
-                                    PQQuoteLiteral(Host).c_str()
-            ));
+            Key << ASession->Session();
+            Key << " ";
+            Key << Action;
+            Key << " ";
+            Key << CanonicalPayload(Payload);
 
-            AConnection->Data().Values("authorized", "false");
-            AConnection->Data().Values("signature", "false");
+            CString Cached;
+            if (bCached && m_ResponseCache.Find(Key, Cached)) {
+                CallReplied(AConnection, UniqueId, Action);
+                WriteMessage(AConnection, CallResult(UniqueId, Action, Cached));
+                return;
+            }
 
-            try {
-                auto pQuery = ExecSQL(SQL, AConnection);
-                pQuery->Data().Values(_T("UniqueId"), UniqueId);
-                pQuery->Data().Values(_T("Action"), Action);
-            } catch (Delphi::Exception::Exception &E) {
-                DoError(AConnection, UniqueId, Action, CHTTPReply::service_unavailable, E);
+            const auto it = m_InFlight.find(Key.c_str());
+            if (it != m_InFlight.end()) {
+                it->second.Waiters.push_back({AConnection, UniqueId});
+                return;
             }
+
+            m_InFlight[Key.c_str()].Generation = m_CacheGeneration;
+
+            PipelineFetch(AConnection, UniqueId, Action, Payload, ASession, Key);
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CWebSocketAPI::AuthorizedFetch(CHTTPServerConnection *AConnection, const CAuthorization &Authorization,
-                const CString &UniqueId, const CString &Action, const CString &Payload, const CString &Agent, const CString &Host) {
+        void CWebSocketAPI::CoalesceReply(const CString &Key, const CWSMessage &Response, const CString &Payload) {
 
-            CStringList SQL;
+            const auto it = m_InFlight.find(Key.c_str());
+            if (it == m_InFlight.end())
+                return;
 
-            if (Authorization.Schema == CAuthorization::asBearer) {
+            // A result read before an invalidating notification may already be stale, it is delivered but not kept.
+            if (Response.MessageTypeId == mtCallResult && it->second.Generation == m_CacheGeneration &&
+                    m_CacheActions.Count() != 0 && MatchAction(m_CacheActions, Response.Action)) {
+                m_ResponseCache.Add(Key, Response.Action, Payload, std::chrono::steady_clock::now() + m_CacheTTL);
+            }
 
-                const auto &caPayload = Payload.IsEmpty() ? "null" : PQQuoteLiteral(Payload);
+            const auto Waiters = std::move(it->second.Waiters);
+            m_InFlight.erase(it);
 
-                SQL.Add(CString()
-                                .MaxFormatSize(256 + Authorization.Token.Size() + Action.Size() + caPayload.Size() + Agent.Size())
-                                .Format("SELECT * FROM daemon.fetch(%s, 'POST', %s, %s::jsonb, %s, %s);",
-                                        PQQuoteLiteral(Authorization.Token).c_str(),
-                                        PQQuoteLiteral(Action).c_str(),
-                                        caPayload.c_str(),
-                                        PQQuoteLiteral(Agent).c_str(),
-                                        PQQuoteLiteral(Host).c_str()
-                ));
+            if (Response.MessageTypeId == mtCallResult) {
+                for (const auto &waiter : Waiters) {
+                    CallReplied(waiter.Connection, waiter.UniqueId, Response.Action);
+                    WriteMessage(waiter.Connection, CallResult(waiter.UniqueId, Response.Action, Payload));
+                }
+                return;
+            }
 
-            } else if (Authorization.Schema == CAuthorization::asBasic) {
+            CWSMessage wsmResponse(Response);
 
-                const auto &caPayload = Payload.IsEmpty() ? "null" : PQQuoteLiteral(Payload);
+            for (const auto &waiter : Waiters) {
+                CallReplied(waiter.Connection, waiter.UniqueId, Response.Action);
+                wsmResponse.UniqueId = waiter.UniqueId;
 
-                SQL.Add(CString()
-                                .MaxFormatSize(256 + Action.Size() + caPayload.Size() + Agent.Size())
-                                .Format("SELECT * FROM daemon.%s_fetch(%s, %s, 'POST', %s, %s::jsonb, %s, %s);",
-                                        Authorization.Type == CAuthorization::atSession ? "session" : "authorized",
-                                        PQQuoteLiteral(Authorization.Username).c_str(),
-                                        PQQuoteLiteral(Authorization.Password).c_str(),
-                                        PQQuoteLiteral(Action).c_str(),
-                                        caPayload.c_str(),
-                                        PQQuoteLiteral(Agent).c_str(),
-                                        PQQuoteLiteral(Host).c_str()
-                ));
+                CString sResponse;
+                CWSProtocol::Response(wsmResponse, sResponse);
 
-            } else {
+                WriteMessage(waiter.Connection, sResponse);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-                return UnauthorizedFetch(AConnection, UniqueId, Action, Payload, Agent, Host);
+        void CWebSocketAPI::InvalidateCache(const CString &Publisher, const CObserverFilter::CEvent &Event) {
 
-            }
+            if (m_CacheActions.Count() == 0)
+                return;
 
-            AConnection->Data().Values("authorized", "true");
-            AConnection->Data().Values("signature", "false");
+            if (m_CacheInvalidate.Count() != 0 && m_CacheInvalidate.IndexOf(Publisher) == -1)
+                return;
 
-            try {
-                auto pQuery = ExecSQL(SQL, AConnection);
-                pQuery->Data().Values(_T("UniqueId"), UniqueId);
-                pQuery->Data().Values(_T("Action"), Action);
-            } catch (Delphi::Exception::Exception &E) {
-                DoError(AConnection, UniqueId, Action, CHTTPReply::service_unavailable, E);
-            }
+            // Index 0 is "entity": only the actions of that entity are dropped, otherwise the whole cache.
+            const CString caEntity((Event.Fields & 1U) != 0 ? Event.Values[0].c_str() : "");
+
+            m_ResponseCache.Invalidate(caEntity);
+            m_CacheGeneration++;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CWebSocketAPI::PreSignedFetch(CHTTPServerConnection *AConnection, const CString &UniqueId,
-                const CString &Action, const CString &Payload, CSession *ASession) {
+        void CWebSocketAPI::CoalesceError(const CString &Key, const CString &Action, int ErrorCode, const CString &Message) {
+            CWSMessage wsmResponse;
 
-            CString sData;
+            wsmResponse.MessageTypeId = mtCallError;
+            wsmResponse.Action = Action;
+            wsmResponse.ErrorCode = ErrorCode;
+            wsmResponse.ErrorMessage = Message;
 
-            const auto& caNonce = LongToString(MsEpoch() * 1000);
+            CoalesceReply(Key, wsmResponse);
+        }
+        //--------------------------------------------------------------------------------------------------------------
 
-            sData = Action;
-            sData << caNonce;
-            sData << (Payload.IsEmpty() ? _T("null") : Payload);
+        void CWebSocketAPI::CoalesceHandOff(const CWSFetch &Fetch) {
+
+            const auto it = m_InFlight.find(Fetch.Key.c_str());
+            if (it == m_InFlight.end())
+                return;
+
+            auto &waiters = it->second.Waiters;
 
-            const auto& caSignature = ASession->Secret().IsEmpty() ? _T("") : hmac_sha256(ASession->Secret(), sData);
+            // The caller has gone before its call was sent: the first waiter still connected takes the call over.
+            while (!waiters.empty()) {
+                const auto waiter = waiters.front();
+                waiters.erase(waiters.begin());
 
-            SignedFetch(AConnection, UniqueId, Action, Payload, ASession->Session(), caNonce, caSignature, ASession->Agent(), ASession->IP());
+                auto pSession = m_SessionIndex.FindByConnection(waiter.Connection);
+                if (pSession != nullptr && !waiter.Connection->ClosedGracefully()) {
+                    PipelineFetch(waiter.Connection, waiter.UniqueId, Fetch.Action, Fetch.Payload, pSession, Fetch.Key);
+                    return;
+                }
+            }
+
+            m_InFlight.erase(it);
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CWebSocketAPI::SignedFetch(CHTTPServerConnection *AConnection, const CString &UniqueId,
-                const CString &Action, const CString &Payload, const CString &Session, const CString &Nonce,
-                const CString &Signature, const CString &Agent, const CString &Host, long int ReceiveWindow) {
-
-            CStringList SQL;
+        void CWebSocketAPI::DoConnectionWorkEnd(CObject *Sender, CWorkMode AWorkMode) {
+            if (AWorkMode != wmWrite)
+                return;
 
-            const auto &caPayload = Payload.IsEmpty() ? "null" : PQQuoteLiteral(Payload);
-
-            SQL.Add(CString()
-                            .MaxFormatSize(256 + Action.Size() + caPayload.Size() + Session.Size() + Nonce.Size() + Signature.Size() + Agent.Size())
-                            .Format("SELECT * FROM daemon.signed_fetch('POST', %s, %s::json, %s, %s, %s, %s, %s, INTERVAL '%d milliseconds');",
-                                    PQQuoteLiteral(Action).c_str(),
-                                    caPayload.c_str(),
-                                    PQQuoteLiteral(Session).c_str(),
-                                    PQQuoteLiteral(Nonce).c_str(),
-                                    PQQuoteLiteral(Signature).c_str(),
-                                    PQQuoteLiteral(Agent).c_str(),
-                                    PQQuoteLiteral(Host).c_str(),
-                                    ReceiveWindow
-            ));
+            // The socket has taken the output buffer, resume the queue as soon as it falls below the low watermark,
+            // then the next parts of a streamed result.
+            auto pConnection = dynamic_cast<CHTTPServerConnection *>(Sender);
+            if (pConnection == nullptr)
+                return;
 
-            AConnection->Data().Values("authorized", "true");
-            AConnection->Data().Values("signature", "true");
+            if (m_Outbound.find(pConnection) != m_Outbound.end())
+                FlushOutbound(pConnection);
 
-            try {
-                auto pQuery = ExecSQL(SQL, AConnection);
-                pQuery->Data().Values(_T("UniqueId"), UniqueId);
-                pQuery->Data().Values(_T("Action"), Action);
-            } catch (Delphi::Exception::Exception &E) {
-                DoError(AConnection, UniqueId, Action, CHTTPReply::service_unavailable, E);
-            }
+            WriteStream(pConnection);
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -434,7 +3924,40 @@ namespace Apostol {
             auto pConnection = dynamic_cast<CHTTPServerConnection *>(Sender);
             if (pConnection != nullptr) {
 
-                auto pSession = m_SessionManager.FindByConnection(pConnection);
+                auto pSession = m_SessionIndex.FindByConnection(pConnection);
+                m_SessionIndex.Disconnect(pConnection);
+                m_Outbound.erase(pConnection);
+
+                // Queued queries still run, their handlers already cope with a connection that has gone.
+                for (auto &jobs : m_Jobs) {
+                    for (auto &job : jobs) {
+                        if (job.Binding == pConnection)
+                            job.Binding = nullptr;
+                    }
+                }
+
+                m_Admission.erase(std::remove_if(m_Admission.begin(), m_Admission.end(), [pConnection](const CWSCall &call) {
+                    return call.Connection == pConnection;
+                }), m_Admission.end());
+
+                for (auto &inflight : m_InFlight) {
+                    auto &waiters = inflight.second.Waiters;
+                    waiters.erase(std::remove_if(waiters.begin(), waiters.end(), [pConnection](const CWSWaiter &waiter) {
+                        return waiter.Connection == pConnection;
+                    }), waiters.end());
+                }
+
+                const auto context = m_Contexts.find(pConnection);
+                if (context != m_Contexts.end()) {
+                    const auto Pending = std::move(context->second.Pending);
+                    DeleteContext(pConnection);
+
+                    for (const auto &fetch : Pending) {
+                        if (!fetch.Key.IsEmpty())
+                            CoalesceHandOff(fetch);
+                    }
+                }
+
                 if (pSession != nullptr) {
                     auto pSocket = pConnection->Socket()->Binding();
                     if (pSocket != nullptr) {
@@ -445,7 +3968,13 @@ namespace Apostol {
                     }
 
                     if (pSession->UpdateCount() == 0) {
+                        const CString caSession(pSession->Session());
+
+                        m_SessionIndex.Delete(pSession);
                         delete pSession;
+
+                        if (m_SessionIndex.List(caSession).empty())
+                            m_ObserverIndex.Delete(caSession);
                     }
                 } else {
                     auto pSocket = pConnection->Socket()->Binding();
@@ -556,8 +4085,6 @@ namespace Apostol {
         //--------------------------------------------------------------------------------------------------------------
 
         void CWebSocketAPI::DoCall(CHTTPServerConnection *AConnection, const CString &Action, const CString &Payload) {
-            auto pWSReply = AConnection->WSReply();
-
             CWSMessage wsmMessage;
 
             wsmMessage.MessageTypeId = mtCall;
@@ -568,21 +4095,71 @@ namespace Apostol {
             CString sResponse;
             CWSProtocol::Response(wsmMessage, sResponse);
 
-            pWSReply->SetPayload(sResponse);
-            AConnection->SendWebSocket(true);
+            WriteMessage(AConnection, sResponse, true);
 
             Log()->Message("[WebSocketAPI] [CALL] [%s] [%s] %s", wsmMessage.UniqueId.c_str(), wsmMessage.Action.c_str(), Payload.c_str());
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        void CWebSocketAPI::DoBroadcast(const std::vector<CHTTPServerConnection *> &Connections, const CString &Action,
+                const CString &Payload) {
+
+            if (Connections.empty())
+                return;
+
+            if (Connections.size() == 1) {
+                if (Connections.front() != nullptr && !Connections.front()->ClosedGracefully())
+                    DoCall(Connections.front(), Action, Payload);
+                return;
+            }
+
+            CWSMessage wsmMessage;
+
+            wsmMessage.MessageTypeId = mtCall;
+            wsmMessage.UniqueId = GetUID(42).Lower();
+            wsmMessage.Action = Action;
+            wsmMessage.Payload << Payload;
+
+            CString sResponse;
+            CWSProtocol::Response(wsmMessage, sResponse);
+
+            // The message is serialized and framed once; for per-recipient ids only the "u" value is spliced in.
+            const auto Pos = m_BroadcastSharedId ? CString::npos : sResponse.Find(wsmMessage.UniqueId);
+
+            CString csFrame;
+            EncodeFrame(WS_OPCODE_TEXT, sResponse, csFrame);
+
+            const auto Offset = Pos == CString::npos ? CString::npos : csFrame.Size() - sResponse.Size() + Pos;
+
+            size_t Count = 0;
+
+            for (auto pConnection : Connections) {
+                if (pConnection == nullptr || pConnection->ClosedGracefully())
+                    continue;
+
+                if (Pos == CString::npos) {
+                    if (!WriteShared(pConnection, csFrame, Offset, CString()))
+                        WriteMessage(pConnection, sResponse, true);
+                } else {
+                    const auto &caUniqueId = GetUID(42).Lower();
+                    if (caUniqueId.Size() != wsmMessage.UniqueId.Size() || !WriteShared(pConnection, csFrame, Offset, caUniqueId)) {
+                        WriteMessage(pConnection, sResponse.SubString(0, Pos) + caUniqueId + sResponse.SubString(Pos + wsmMessage.UniqueId.Size()), true);
+                    }
+                }
+
+                Count++;
+            }
+
+            Log()->Message("[WebSocketAPI] [BROADCAST] [%s] [%s] [%d] %s", wsmMessage.UniqueId.c_str(), wsmMessage.Action.c_str(), (int) Count, Payload.c_str());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         void CWebSocketAPI::DoError(CHTTPServerConnection *AConnection, const CString &UniqueId, const CString &Action,
                 CHTTPReply::CStatusType Status, const std::exception &e) {
 
             if (AConnection->ClosedGracefully())
                 return;
 
-            auto pWSReply = AConnection->WSReply();
-
             CWSMessage wsmMessage;
 
             wsmMessage.MessageTypeId = mtCallError;
@@ -593,11 +4170,12 @@ namespace Apostol {
             wsmMessage.ErrorCode = Status;
             wsmMessage.ErrorMessage = e.what();
 
+            CallReplied(AConnection, UniqueId, wsmMessage.Action);
+
             CString sResponse;
             CWSProtocol::Response(wsmMessage, sResponse);
 
-            pWSReply->SetPayload(sResponse);
-            AConnection->SendWebSocket(true);
+            WriteMessage(AConnection, sResponse);
 
             Log()->Error(APP_LOG_ERR, 0, "[WebSocketAPI] [ERROR] [%s] [%s] [%d] %s", wsmMessage.UniqueId.c_str(), wsmMessage.Action.c_str(), wsmMessage.ErrorCode, e.what());
         }
@@ -610,33 +4188,97 @@ namespace Apostol {
             pReply->ContentType = CHTTPReply::json;
 
             try {
-                if (Action == "list") {
-                    CJSONValue jsonArray(jvtArray);
+                if (Action == "metrics") {
+                    DoMetrics(AConnection);
+                } else if (Action == "list" || Action == "count") {
+                    const auto &caParams = AConnection->Request()->Params;
+
+                    const auto &caAuthorized = caParams.Values(_T("authorized"));
+                    const auto &caPrefix = caParams.Values(_T("session"));
+                    const auto &caIdentity = caParams.Values(_T("identity"));
+                    const auto &caHost = caParams.Values(_T("host"));
+
+                    const auto Offset = std::max(atoi(caParams.Values(_T("offset")).c_str()), 0);
+                    const auto Limit = std::max(atoi(caParams.Values(_T("limit")).c_str()), 0);
+
+                    const auto Match = [&](CSession *ASession) {
+                        if (!caAuthorized.IsEmpty() && ASession->Authorized() != (caAuthorized == _T("true")))
+                            return false;
+                        if (!caPrefix.IsEmpty() && ASession->Session().SubString(0, caPrefix.Size()) != caPrefix)
+                            return false;
+                        if (!caIdentity.IsEmpty() && ASession->Identity() != caIdentity)
+                            return false;
+                        if (!caHost.IsEmpty() && ASession->IP() != caHost)
+                            return false;
+                        return true;
+                    };
 
-                    for (int i = 0; i < m_SessionManager.Count(); i++) {
-                        CJSONValue jsonSession(jvtObject);
-                        CJSONValue jsonConnection(jvtObject);
+                    // The body is written as text session by session, no JSON tree is built.
+                    std::string Output;
+
+                    size_t Matched = 0;
+                    size_t Connected = 0;
+                    size_t Authorized = 0;
+                    size_t Listed = 0;
 
+                    if (Action == "list")
+                        Output.push_back('[');
+
+                    for (int i = 0; i < m_SessionManager.Count(); i++) {
                         auto pSession = m_SessionManager[i];
 
-                        jsonSession.Object().AddPair("session", pSession->Session());
-                        jsonSession.Object().AddPair("identity", pSession->Identity());
-                        jsonSession.Object().AddPair("authorized", pSession->Authorized());
+                        if (!Match(pSession))
+                            continue;
+
+                        auto pConnection = pSession->Connection();
+                        if (pConnection != nullptr && pConnection->ClosedGracefully())
+                            pConnection = nullptr;
+
+                        if (Action == "count") {
+                            Matched++;
+                            if (pConnection != nullptr)
+                                Connected++;
+                            if (pSession->Authorized())
+                                Authorized++;
+                            continue;
+                        }
+
+                        if (Matched++ < (size_t) Offset)
+                            continue;
 
-                        if (pSession->Connection() != nullptr && !pSession->Connection()->ClosedGracefully()) {
-                            jsonConnection.Object().AddPair("socket", pSession->Connection()->Socket()->Binding()->Handle());
-                            jsonConnection.Object().AddPair("host", pSession->Connection()->Socket()->Binding()->PeerIP());
-                            jsonConnection.Object().AddPair("port", pSession->Connection()->Socket()->Binding()->PeerPort());
+                        if (Limit != 0 && Listed == (size_t) Limit)
+                            break;
 
-                            jsonSession.Object().AddPair("connection", jsonConnection);
+                        if (Listed++ != 0)
+                            Output.push_back(',');
+
+                        Output.append("{\"session\":");
+                        QuoteJson(Output, pSession->Session());
+                        Output.append(",\"identity\":");
+                        QuoteJson(Output, pSession->Identity());
+                        Output.append(pSession->Authorized() ? ",\"authorized\":true" : ",\"authorized\":false");
+
+                        if (pConnection != nullptr) {
+                            auto pBinding = pConnection->Socket()->Binding();
+
+                            Output.append(",\"connection\":{\"socket\":").append(std::to_string(pBinding->Handle()));
+                            Output.append(",\"host\":");
+                            QuoteJson(Output, pBinding->PeerIP());
+                            Output.append(",\"port\":").append(std::to_string(pBinding->PeerPort())).append("}}");
                         } else {
-                            jsonSession.Object().AddPair("connection", CJSONValue());
+                            Output.append(",\"connection\":null}");
                         }
+                    }
 
-                        jsonArray.Array().Add(jsonSession);
+                    if (Action == "list") {
+                        Output.push_back(']');
+                    } else {
+                        Output.append("{\"count\":").append(std::to_string(Matched));
+                        Output.append(",\"connected\":").append(std::to_string(Connected));
+                        Output.append(",\"authorized\":").append(std::to_string(Authorized)).push_back('}');
                     }
 
-                    pReply->Content = jsonArray.ToString();
+                    pReply->Content = CString(Output.data(), Output.size());
 
                     AConnection->SendReply(CHTTPReply::ok);
                 } else {
@@ -648,6 +4290,92 @@ namespace Apostol {
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        void CWebSocketAPI::DoMetrics(CHTTPServerConnection *AConnection) {
+
+            auto pReply = AConnection->Reply();
+
+            std::string Output;
+            m_Metrics.Write(Output);
+
+            const auto Gauge = [&Output](const char *Name, const char *Help) {
+                Output.append("# HELP ").append(Name).append(" ").append(Help).push_back('\n');
+                Output.append("# TYPE ").append(Name).append(" gauge\n");
+            };
+
+            size_t Connected = 0;
+            size_t Authorized = 0;
+
+            for (int i = 0; i < m_SessionManager.Count(); ++i) {
+                auto pSession = m_SessionManager[i];
+                if (pSession->Connection() != nullptr && !pSession->Connection()->ClosedGracefully())
+                    Connected++;
+                if (pSession->Authorized())
+                    Authorized++;
+            }
+
+            Gauge("ws_sessions", "Sessions of this worker.");
+            Output.append("ws_sessions{state=\"connected\"} ").append(std::to_string(Connected)).push_back('\n');
+            Output.append("ws_sessions{state=\"authorized\"} ").append(std::to_string(Authorized)).push_back('\n');
+
+            Gauge("ws_calls_in_flight", "Calls sent to the database and not answered yet.");
+            Output.append("ws_calls_in_flight ").append(std::to_string(m_InFlightCalls)).push_back('\n');
+
+            Gauge("ws_admission_queue", "Calls waiting for an in-flight slot.");
+            Output.append("ws_admission_queue ").append(std::to_string(m_Admission.size())).push_back('\n');
+
+            Gauge("ws_scheduler_queue", "Queries waiting in the scheduler per class.");
+            for (int i = 0; i < qcCount; ++i)
+                Output.append("ws_scheduler_queue{class=\"").append(QueryClassNames[i]).append("\"} ").append(std::to_string(m_Jobs[i].size())).push_back('\n');
+
+            Gauge("ws_scheduler_running", "Queries running per class.");
+            for (int i = 0; i < qcCount; ++i)
+                Output.append("ws_scheduler_running{class=\"").append(QueryClassNames[i]).append("\"} ").append(std::to_string(m_Running[i])).push_back('\n');
+
+            size_t Outbound = 0;
+            for (const auto &queue : m_Outbound)
+                Outbound += queue.second.Size();
+
+            Gauge("ws_outbound_queue_bytes", "Messages held back for slow consumers.");
+            Output.append("ws_outbound_queue_bytes ").append(std::to_string(Outbound)).push_back('\n');
+
+            Gauge("ws_response_cache_bytes", "Size of the response cache.");
+            Output.append("ws_response_cache_bytes ").append(std::to_string(m_ResponseCache.Size())).push_back('\n');
+
+            pReply->ContentType = CHTTPReply::text;
+            pReply->Content = CString(Output.data(), Output.size());
+
+            AConnection->SendReply(CHTTPReply::ok);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::CallStarted(CHTTPServerConnection *AConnection, const CString &UniqueId) {
+            if (UniqueId.IsEmpty())
+                return;
+
+            auto &calls = m_Contexts[AConnection].Calls;
+
+            // A client that never waits for its replies does not get an unbounded table.
+            if (calls.size() < 1024)
+                calls[UniqueId.c_str()] = std::chrono::steady_clock::now();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::CallReplied(CHTTPServerConnection *AConnection, const CString &UniqueId, const CString &Action) {
+            const auto context = m_Contexts.find(AConnection);
+            if (context == m_Contexts.end())
+                return;
+
+            auto &calls = context->second.Calls;
+
+            const auto it = calls.find(UniqueId.c_str());
+            if (it == calls.end())
+                return;
+
+            m_Metrics.Call(Action, std::chrono::duration<double>(std::chrono::steady_clock::now() - it->second).count());
+            calls.erase(it);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         void CWebSocketAPI::DoPost(CHTTPServerConnection *AConnection) {
 
             auto pRequest = AConnection->Request();
@@ -663,20 +4391,19 @@ namespace Apostol {
                 return;
             }
 
-            CSession *pSession;
-            bool bSent = false;
-
             const auto& caSession = slRouts[1];
             const auto& caIdentity = slRouts.Count() == 3 ? slRouts[2] : CString();
 
             CAuthorization Authorization;
             if (CheckTokenAuthorization(AConnection, caSession, Authorization)) {
-                for (int i = 0; i < m_SessionManager.Count(); ++i) {
-                    pSession = m_SessionManager[i];
-                    if ((pSession->Session() == caSession) && (caIdentity.IsEmpty() ? true : pSession->Identity() == caIdentity) && pSession->Authorized()) {
-                        DoCall(pSession->Connection(), "/ws", pRequest->Content);
+                auto bSent = Deliver(caSession, caIdentity, pRequest->Content);
+
+                // Connections of the session may be held by other workers.
+                if (m_SessionDirectory.Active() && (caIdentity.IsEmpty() || !bSent)) {
+                    std::vector<pid_t> Workers;
+                    m_SessionDirectory.Find(caSession, caIdentity, Workers);
+                    if (Relay(Workers, caSession, caIdentity, pRequest->Content))
                         bSent = true;
-                    }
                 }
 
                 pReply->Content.Clear();
@@ -691,6 +4418,118 @@ namespace Apostol {
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        bool CWebSocketAPI::Deliver(const CString &Session, const CString &Identity, const CString &Payload) {
+            std::vector<CHTTPServerConnection *> Connections;
+
+            // Only live connections count as delivered, otherwise the message is relayed to other workers.
+            const auto Live = [](CSession *ASession) {
+                const auto pConnection = ASession->Connection();
+                return ASession->Authorized() && pConnection != nullptr && pConnection->Connected() && !pConnection->ClosedGracefully();
+            };
+
+            if (Identity.IsEmpty()) {
+                for (auto pItem : m_SessionIndex.List(Session)) {
+                    if (Live(pItem))
+                        Connections.push_back(pItem->Connection());
+                }
+            } else {
+                auto pSession = m_SessionIndex.Find(Session, Identity);
+                if (pSession != nullptr && Live(pSession))
+                    Connections.push_back(pSession->Connection());
+            }
+
+            DoBroadcast(Connections, "/ws", Payload);
+
+            return !Connections.empty();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        bool CWebSocketAPI::Relay(const std::vector<pid_t> &Workers, const CString &Session, const CString &Identity,
+                const CString &Payload) {
+
+            if (Workers.empty())
+                return false;
+
+            std::string Data;
+
+            Data.append("{\"session\":");
+            QuoteJson(Data, Session);
+            Data.append(",\"identity\":");
+            QuoteJson(Data, Identity);
+            Data.append(",\"data\":");
+            QuoteJson(Data, Payload);
+
+            // Any database role may NOTIFY the relay channel, the receiver only accepts messages signed by a worker.
+            Data.append(",\"sign\":");
+            QuoteJson(Data, m_SessionDirectory.Sign(CString(Data.data(), Data.size())));
+            Data.push_back('}');
+
+            if (Data.size() > WS_NOTIFY_PAYLOAD_MAX) {
+                Log()->Error(APP_LOG_WARN, 0, "[WebSocketAPI] Message for session %s is too large to relay to another worker (%d bytes).",
+                             Session.c_str(), (int) Data.size());
+                return false;
+            }
+
+            // Workers sharing one listener exchange the message directly, without a round trip to the database.
+            if (m_NotifyRing.Active()) {
+                const CString caData(Data.data(), Data.size());
+
+                bool bSent = false;
+                for (const auto pid : Workers) {
+                    if (m_NotifyRing.Publish(CString().Format("ws_%d", (int) pid), caData, pid))
+                        bSent = true;
+                }
+
+                return bSent;
+            }
+
+            auto OnExecuted = [](CPQPollQuery *APollQuery) {
+                auto pResult = APollQuery->Results(0);
+                if (pResult->ExecStatus() != PGRES_TUPLES_OK)
+                    DoError(Delphi::Exception::EDBError(pResult->GetErrorMessage()));
+            };
+
+            auto OnException = [](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                DoError(E);
+            };
+
+            CStringList SQL;
+
+            const auto caData = PQQuoteLiteral(CString(Data.data(), Data.size()));
+            for (const auto pid : Workers)
+                SQL.Add(CString().Format("SELECT pg_notify('ws_%d', %s);", (int) pid, caData.c_str()));
+
+            try {
+                Schedule(qcObserver, SQL, nullptr, OnExecuted, OnException);
+            } catch (Delphi::Exception::Exception &E) {
+                DoError(E);
+                return false;
+            }
+
+            return true;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::DoRelay(const CString &Data) {
+            try {
+                CJSON Json;
+                Json << Data;
+
+                const auto Pos = Data.Find(",\"sign\":");
+                const auto &caSign = Json[_T("sign")].AsString();
+                const auto &caExpected = m_SessionDirectory.Sign(Pos == CString::npos ? CString() : Data.SubString(0, Pos));
+
+                if (Pos == CString::npos || caExpected.IsEmpty() || caSign.Size() != caExpected.Size() ||
+                        CRYPTO_memcmp(caSign.c_str(), caExpected.c_str(), caExpected.Size()) != 0)
+                    throw Delphi::Exception::Exception(_T("Message is not signed by a worker."));
+
+                Deliver(Json[_T("session")].AsString(), Json[_T("identity")].AsString(), Json[_T("data")].AsString());
+            } catch (std::exception &e) {
+                Log()->Error(APP_LOG_ERR, 0, "[WebSocketAPI] Relay: %s", e.what());
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         void CWebSocketAPI::DoGet(CHTTPServerConnection *AConnection) {
 
             auto pRequest = AConnection->Request();
@@ -728,16 +4567,46 @@ namespace Apostol {
             }
 
             const CString csAccept(SHA1(caSecWebSocketKey + _T("258EAFA5-E914-47DA-95CA-C5AB0DC85B11")));
-            const CString csProtocol(caSecWebSocketProtocol.IsEmpty() ? "" : caSecWebSocketProtocol.SubString(0, caSecWebSocketProtocol.Find(',')));
+            CString csProtocol(caSecWebSocketProtocol.IsEmpty() ? "" : caSecWebSocketProtocol.SubString(0, caSecWebSocketProtocol.Find(',')));
+
+            bool bDeflate = false;
+            bool bMsgPack = false;
+
+            // Large lists are split into parts of at most this many rows when the client asks for it.
+            size_t Chunk = 0;
+            if (m_StreamChunk > 0) {
+                const auto& caChunk = pRequest->Params.Values(_T("chunk"));
+                if (!caChunk.IsEmpty())
+                    Chunk = std::min((size_t) std::max(atoi(caChunk.c_str()), 0), m_StreamChunk);
+            }
+
+            if ((m_Deflate || m_MsgPack) && !caSecWebSocketProtocol.IsEmpty()) {
+                CStringList slProtocols;
+                SplitColumns(caSecWebSocketProtocol, slProtocols, ',');
+
+                for (int i = 0; i < slProtocols.Count(); ++i) {
+                    const auto &protocol = slProtocols[i].Trim();
+
+                    bMsgPack = m_MsgPack && (protocol == WS_PROTOCOL_MSGPACK || (m_Deflate && protocol == WS_PROTOCOL_MSGPACK_DEFLATE));
+                    bDeflate = m_Deflate && (protocol == WS_PROTOCOL_DEFLATE || (m_MsgPack && protocol == WS_PROTOCOL_MSGPACK_DEFLATE));
+
+                    if (bMsgPack || bDeflate) {
+                        csProtocol = protocol;
+                        break;
+                    }
+                }
+            }
 
-            auto pSession = m_SessionManager.Find(caSession, caIdentity);
+            auto pSession = m_SessionIndex.Find(caSession, caIdentity);
 
             if (pSession == nullptr) {
                 pSession = m_SessionManager.Add(AConnection);
                 pSession->Session() = caSession;
                 pSession->Identity() = caIdentity;
+                m_SessionIndex.Add(pSession);
             } else {
                 pSession->SwitchConnection(AConnection);
+                m_SessionIndex.Update(pSession);
             }
 
             pSession->IP() = GetRealIP(AConnection);
@@ -745,8 +4614,10 @@ namespace Apostol {
 
 #if defined(_GLIBCXX_RELEASE) && (_GLIBCXX_RELEASE >= 9)
             AConnection->OnDisconnected([this](auto && Sender) { DoSessionDisconnected(Sender); });
+            AConnection->OnWorkEnd([this](auto && Sender, auto && AWorkMode) { DoConnectionWorkEnd(Sender, AWorkMode); });
 #else
             AConnection->OnDisconnected(std::bind(&CWebSocketAPI::DoSessionDisconnected, this, _1));
+            AConnection->OnWorkEnd(std::bind(&CWebSocketAPI::DoConnectionWorkEnd, this, _1, _2));
 #endif
 
             const auto checkAuth = CheckSessionAuthorization(pSession);
@@ -757,7 +4628,22 @@ namespace Apostol {
                 return;
             }
 
+            if (bDeflate || bMsgPack || Chunk > 0) {
+                auto &context = m_Contexts[AConnection];
+                context.Deflate = bDeflate;
+                context.MsgPack = bMsgPack;
+                context.Chunk = Chunk;
+            } else {
+                DeleteContext(AConnection);
+            }
+
             AConnection->SwitchingProtocols(csAccept, csProtocol);
+
+            // Another worker or connection may have changed the listeners of the session in the meantime.
+            m_ObserverIndex.Forget(pSession->Session());
+
+            if (pSession->Authorized())
+                ObserverDiscovery(pSession);
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -766,6 +4652,8 @@ namespace Apostol {
             auto pWSRequest = AConnection->WSRequest();
             const CString csRequest(pWSRequest->Payload());
 
+            m_Metrics.Received(csRequest.Size());
+
             try {
                 if (!AConnection->Connected())
                     return;
@@ -773,10 +4661,56 @@ namespace Apostol {
                 CWSMessage wsmRequest;
                 CWSMessage wsmResponse;
 
-                auto pSession = CSession::FindOfConnection(AConnection);
+                auto pSession = m_SessionIndex.FindByConnection(AConnection);
+
+                // Raw JSON text of "p", it is passed to the database without being parsed.
+                CString csPayload;
 
                 try {
-                    CWSProtocol::Request(csRequest, wsmRequest);
+                    if (IsMsgPack(AConnection)) {
+                        // MessagePack frames are binary either way, a compressed one is told apart by failing to decode.
+                        if (!CMsgPack::Decode(csRequest, wsmRequest, csPayload)) {
+                            CString csInflated;
+                            if (IsDeflate(AConnection) && !InflateRequest(AConnection, csRequest, csInflated)) {
+                                InflateFailed(AConnection);
+                                return;
+                            }
+                            if (csInflated.IsEmpty() || !CMsgPack::Decode(csInflated, wsmRequest, csPayload))
+                                throw Delphi::Exception::Exception(_T("Invalid message format."));
+                        }
+                    } else {
+                        // A client that negotiated WS_PROTOCOL_DEFLATE sends compressed messages in binary frames only.
+                        CString csInflated;
+                        const auto bCompressed = pWSRequest->Frame().Opcode == WS_OPCODE_BINARY && IsDeflate(AConnection);
+                        if (bCompressed && !InflateRequest(AConnection, csRequest, csInflated)) {
+                            InflateFailed(AConnection);
+                            return;
+                        }
+
+                        const auto &csMessage = bCompressed ? csInflated : csRequest;
+
+                        if (!CMsgPack::Split(csMessage, wsmRequest, csPayload)) {
+                            // Not a plain JSON object: the full parser reports the error.
+                            wsmRequest = CWSMessage();
+                            csPayload.Clear();
+
+                            CWSProtocol::Request(csMessage, wsmRequest);
+                        }
+                    }
+
+                    // Neither the envelope scanner nor the MessagePack decoder parses "p", the database would be the first to.
+                    if (!csPayload.IsEmpty() && !CMsgPack::Valid(csPayload))
+                        throw Delphi::Exception::Exception(_T("Invalid payload format."));
+
+                    // Only OPEN looks inside the payload, calls pass it on as text.
+                    if (wsmRequest.MessageTypeId == mtOpen && !csPayload.IsEmpty())
+                        wsmRequest.Payload << csPayload;
+
+                    if (wsmRequest.MessageTypeId == mtOpen || wsmRequest.MessageTypeId == mtClose || wsmRequest.MessageTypeId == mtCall)
+                        CallStarted(AConnection, wsmRequest.UniqueId);
+
+                    if (pSession == nullptr)
+                        throw Delphi::Exception::Exception(_T("Session not found."));
 
                     if (wsmRequest.MessageTypeId == mtOpen) {
                         if (wsmRequest.Payload.HasOwnProperty(_T("secret"))) {
@@ -843,16 +4777,14 @@ namespace Apostol {
                         if (wsmRequest.Action.SubString(0, 8) != _T("/api/v1/"))
                             wsmRequest.Action = _T("/api/v1") + wsmRequest.Action;
 
-                        if (caAuthorization.Schema != CAuthorization::asUnknown) {
-                            AuthorizedFetch(AConnection, caAuthorization, wsmRequest.UniqueId, wsmRequest.Action, wsmRequest.Payload.ToString(), pSession->Agent(), pSession->IP());
-                        } else {
-                            PreSignedFetch(AConnection, wsmRequest.UniqueId, wsmRequest.Action, wsmRequest.Payload.ToString(), pSession);
-                        }
+                        AdmitCall(AConnection, wsmRequest.UniqueId, wsmRequest.Action, csPayload.IsEmpty() ? wsmRequest.Payload.ToString() : csPayload, pSession);
                     }
                 } catch (jwt::token_expired_exception &e) {
                     DoError(AConnection, wsmRequest.UniqueId, wsmRequest.Action, CHTTPReply::forbidden, e);
                 } catch (CAuthorizationError &e) {
                     DoError(AConnection, wsmRequest.UniqueId, wsmRequest.Action, CHTTPReply::unauthorized, e);
+                } catch (CTooManyRequests &e) {
+                    DoError(AConnection, wsmRequest.UniqueId, wsmRequest.Action, WS_TOO_MANY_REQUESTS, e);
                 } catch (std::exception &e) {
                     DoError(AConnection, wsmRequest.UniqueId, wsmRequest.Action, CHTTPReply::bad_request, e);
                 }
@@ -865,8 +4797,140 @@ namespace Apostol {
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        void CWebSocketAPI::ReadList(const CString &Key, CStringList &List) {
+            List.Clear();
+
+            const auto &caValue = Config()->IniFile().ReadString("worker/WebSocketAPI", Key, "");
+            if (caValue.IsEmpty())
+                return;
+
+            SplitColumns(caValue, List, ',');
+            for (int i = 0; i < List.Count(); ++i)
+                List[i] = List[i].Trim();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        size_t CWebSocketAPI::ReadSize(const CString &Key, int Default, int Min) {
+            const auto Value = Config()->IniFile().ReadInteger("worker/WebSocketAPI", Key, Default);
+
+            if (Value < Min) {
+                Log()->Error(APP_LOG_WARN, 0, "[WebSocketAPI] Invalid value %d of \"%s\" (minimum %d), using %d.",
+                             Value, Key.c_str(), Min, Default);
+                return (size_t) Default;
+            }
+
+            return (size_t) Value;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         void CWebSocketAPI::Initialization(CModuleProcess *AProcess) {
             CApostolModule::Initialization(AProcess);
+
+            m_ObserverBatch = Config()->IniFile().ReadBool("worker/WebSocketAPI", "observer_batch", false);
+            m_ObserverBatchSize = (int) ReadSize("observer_batch_size", 500, 1);
+
+            m_ObserverLocal = Config()->IniFile().ReadBool("worker/WebSocketAPI", "observer_local", false);
+
+            m_ObserverIndex.Prune(Config()->IniFile().ReadBool("worker/WebSocketAPI", "observer_prune", false),
+                                  std::chrono::seconds(ReadSize("observer_prune_ttl", 60, 1)));
+
+            m_BroadcastSharedId = Config()->IniFile().ReadBool("worker/WebSocketAPI", "broadcast_shared_id", false);
+
+            m_RelayChannel.Clear();
+            m_SessionIndex.Directory(nullptr);
+
+            m_ListenReplay = Config()->IniFile().ReadBool("worker/WebSocketAPI", "listen_replay", false);
+
+            m_NotifyLeader = false;
+
+            if (m_NotifyHandler != nullptr) {
+                m_NotifyHandler->Stop();
+                delete m_NotifyHandler;
+                m_NotifyHandler = nullptr;
+            }
+
+            m_NotifyRing.Close();
+
+            if (Config()->IniFile().ReadBool("worker/WebSocketAPI", "listen_shared", false)) {
+                if (m_NotifyRing.Open(ReadSize("listen_ring_size", 512, 1))) {
+                    m_NotifyLeader = m_NotifyRing.Leader();
+
+                    // Publishers wake the readers directly, the heartbeat poll is only a fallback.
+                    if (m_NotifyRing.Handle() != -1) {
+                        m_NotifyHandler = Server().EventHandlers()->Add(m_NotifyRing.Handle());
+                        m_NotifyHandler->OnReadEvent([this](CPollEventHandler *AHandler) {
+                            m_NotifyRing.Drain();
+                            PollNotify();
+                        });
+                        m_NotifyHandler->Start(etIO);
+                    }
+                } else {
+                    Log()->Error(APP_LOG_ERR, errno, "[WebSocketAPI] Could not open the notification ring.");
+                }
+            }
+
+            if (Config()->IniFile().ReadBool("worker/WebSocketAPI", "session_directory", false)) {
+                if (m_SessionDirectory.Open(ReadSize("session_directory_size", 16384, 1))) {
+                    m_RelayChannel = CString().Format("ws_%d", (int) getpid());
+                    m_SessionIndex.Directory(&m_SessionDirectory);
+                } else {
+                    Log()->Error(APP_LOG_ERR, errno, "[WebSocketAPI] Could not open the session directory.");
+                }
+            }
+
+            m_OutboundHighWatermark = ReadSize("outbound_high_watermark", 1024, 1) * 1024;
+            m_OutboundLowWatermark = ReadSize("outbound_low_watermark", 256) * 1024;
+            m_OutboundLimit = ReadSize("outbound_limit", 8192, 1) * 1024;
+            m_OutboundCloseSlow = Config()->IniFile().ReadString("worker/WebSocketAPI", "outbound_policy", "drop") == "close";
+
+            if (m_OutboundLowWatermark > m_OutboundHighWatermark)
+                m_OutboundLowWatermark = m_OutboundHighWatermark;
+
+            m_MsgPack = Config()->IniFile().ReadBool("worker/WebSocketAPI", "msgpack", true);
+
+            m_PreparedStatements = Config()->IniFile().ReadBool("worker/WebSocketAPI", "prepared_statements", false);
+            m_TrustedSecret = Config()->IniFile().ReadBool("worker/WebSocketAPI", "trusted_secret", false);
+
+            ReadList("readonly_actions", m_ReadOnlyActions);
+            ReadList("cache_actions", m_CacheActions);
+            ReadList("cache_invalidate", m_CacheInvalidate);
+
+            m_RateLimit = (double) ReadSize("rate_limit", 0);
+            m_RateBurst = (double) ReadSize("rate_burst", 20, 1);
+
+            m_MaxInFlight = ReadSize("max_in_flight", 0);
+            m_AdmissionLimit = ReadSize("admission_queue", 1000);
+            m_StreamChunk = ReadSize("stream_chunk", 0);
+
+            m_SchedulerSlots = ReadSize("scheduler_slots", 0);
+
+            static const int Weights[qcCount] = {4, 2, 1};
+
+            for (int i = 0; i < qcCount; ++i) {
+                m_Reserve[i] = ReadSize(CString("scheduler_reserve_") + QueryClassNames[i], i == qcObserver ? 0 : 1);
+                m_Weight[i] = (int) ReadSize(CString("scheduler_weight_") + QueryClassNames[i], Weights[i], 1);
+            }
+
+            m_CacheTTL = std::chrono::seconds(ReadSize("cache_ttl", 30));
+            m_ResponseCache.Limit(ReadSize("cache_size", 16384) * 1024);
+
+            m_Pipeline = Config()->IniFile().ReadBool("worker/WebSocketAPI", "pipeline", false);
+            m_PipelineDepth = ReadSize("pipeline_depth", 16, 1);
+
+            m_TokenCache.Capacity(ReadSize("token_cache_size", 4096));
+            m_TokenCacheTTL = std::chrono::seconds(ReadSize("token_cache_ttl", 300));
+
+            CheckProviders();
+
+            m_Deflate = Config()->IniFile().ReadBool("worker/WebSocketAPI", "deflate", true);
+            m_DeflateThreshold = ReadSize("deflate_threshold", 1024);
+            m_DeflateContextTakeover = Config()->IniFile().ReadBool("worker/WebSocketAPI", "deflate_context_takeover", false);
+            m_MaxMessageSize = ReadSize("max_message_size", 1048576, 1);
+
+            m_DeflatePool.Init(Config()->IniFile().ReadInteger("worker/WebSocketAPI", "deflate_level", Z_DEFAULT_COMPRESSION),
+                               Config()->IniFile().ReadInteger("worker/WebSocketAPI", "deflate_window_bits", 15),
+                               Config()->IniFile().ReadInteger("worker/WebSocketAPI", "deflate_memory_level", 8),
+                               ReadSize("deflate_pool_size", 64));
         }
         //--------------------------------------------------------------------------------------------------------------
 
@@ -886,51 +4950,73 @@ namespace Apostol {
 
         CString CWebSocketAPI::VerifyToken(const CString &Token) {
 
+            CString Subject;
+            if (m_TokenCache.Find(Token, Subject))
+                return Subject;
+
             auto decoded = jwt::decode(Token);
 
             const auto& aud = CString(decoded.get_audience());
             const auto& alg = CString(decoded.get_algorithm());
             const auto& iss = CString(decoded.get_issuer());
 
-            const auto& Providers = Server().Providers();
-
-            CString Application;
-            const auto Index = OAuth2::Helper::ProviderByClientId(Providers, aud, Application);
-            if (Index == -1)
-                throw COAuth2Error(_T("Not found provider by Client ID."));
+            const auto pAudience = m_TokenVerifiers->Find(aud);
 
-            const auto& Provider = Providers[Index].Value();
-            const auto& Secret = OAuth2::Helper::GetSecret(Provider, Application);
-
-            CStringList Issuers;
-            Provider.GetIssuers(Application, Issuers);
-            if (Issuers[iss].IsEmpty())
+            if (pAudience->Issuers[iss].IsEmpty())
                 throw jwt::token_verification_exception("Token doesn't contain the required issuer.");
 
             if (alg == "HS256") {
-                auto verifier = jwt::verify()
-                        .allow_algorithm(jwt::algorithm::hs256{Secret});
-                verifier.verify(decoded);
+                pAudience->HS256.verify(decoded);
             } else if (alg == "HS384") {
-                auto verifier = jwt::verify()
-                        .allow_algorithm(jwt::algorithm::hs384{Secret});
-                verifier.verify(decoded);
+                pAudience->HS384.verify(decoded);
             } else if (alg == "HS512") {
-                auto verifier = jwt::verify()
-                        .allow_algorithm(jwt::algorithm::hs512{Secret});
-                verifier.verify(decoded);
+                pAudience->HS512.verify(decoded);
+            } else {
+                throw jwt::token_verification_exception("Token signature algorithm is not supported.");
             }
 
-            return decoded.get_payload_claim("sub").as_string();
+            Subject = decoded.get_payload_claim("sub").as_string();
+
+            auto Expires = std::chrono::system_clock::now() + m_TokenCacheTTL;
+            if (decoded.has_expires_at() && decoded.get_expires_at() < Expires)
+                Expires = decoded.get_expires_at();
+
+            m_TokenCache.Add(Token, Subject, Expires);
+
+            return Subject;
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CWebSocketAPI::Observer(CSession *ASession, const CString &Publisher, const CString &Data) {
+        CString CWebSocketAPI::ProvidersFingerprint() {
+            const auto& Providers = Server().Providers();
 
-            auto OnExecuted = [ASession](CPQPollQuery *APollQuery) {
+            // The parameters hold the client ids, secrets and issuers of every application of the provider.
+            CString Result;
+            for (int i = 0; i < Providers.Count(); ++i) {
+                Result << Providers[i].Name();
+                Result << "=";
+                Result << Providers[i].Value().Params.ToString();
+                Result << ";";
+            }
 
-                if (ASession == nullptr)
-                    return;
+            return Result;
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::CheckProviders() {
+            // Verifiers and verified tokens are only valid for the provider configuration they were built from.
+            const auto& caFingerprint = ProvidersFingerprint();
+            if (caFingerprint == m_TokenVerifiers->Fingerprint())
+                return;
+
+            m_TokenCache.Clear();
+            m_TokenVerifiers = std::make_shared<CTokenVerifiers>(caFingerprint, Server().Providers());
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::Observer(CSession *ASession, const CString &Publisher, const CString &Data) {
+
+            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
 
                 auto pConnection = dynamic_cast<CHTTPServerConnection *> (APollQuery->Binding());
 
@@ -940,25 +5026,33 @@ namespace Apostol {
                 if (pConnection->ClosedGracefully())
                     return;
 
+                auto pSession = m_SessionIndex.FindByConnection(pConnection);
+
+                if (pSession == nullptr)
+                    return;
+
                 CHTTPReply::CStatusType status = CHTTPReply::internal_server_error;
 
                 try {
-                    auto pResult = APollQuery->Results(0);
+                    auto pResult = APollQuery->Results(APollQuery->ResultCount() - 1);
 
                     if (pResult->ExecStatus() != PGRES_TUPLES_OK) {
                         throw Delphi::Exception::EDBError(pResult->GetErrorMessage());
                     }
 
+                    m_Metrics.ObserverRows(APollQuery->Data()["publisher"], pResult->nTuples());
+
                     if (pResult->nTuples() == 1) {
                         const CJSON Payload(pResult->GetValue(0, 0));
                         CString errorMessage;
 
                         status = ErrorCodeToStatus(CheckError(Payload, errorMessage));
                         if (status == CHTTPReply::unauthorized) {
-                            ASession->Session().Clear();
-                            ASession->Secret().Clear();
-                            ASession->Authorization().Clear();
-                            ASession->Authorized(false);
+                            pSession->Session().Clear();
+                            pSession->Secret().Clear();
+                            pSession->Authorization().Clear();
+                            pSession->Authorized(false);
+                            m_SessionIndex.Update(pSession);
                         }
 
                         if (status != CHTTPReply::ok) {
@@ -977,7 +5071,7 @@ namespace Apostol {
                 }
             };
 
-            auto OnException = [](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+            auto OnException = [this](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
                 auto pConnection = dynamic_cast<CHTTPServerConnection *> (APollQuery->Binding());
                 if (pConnection != nullptr && !pConnection->ClosedGracefully())
                     DoError(pConnection, CString(), CString(), CHTTPReply::service_unavailable, E);
@@ -985,20 +5079,149 @@ namespace Apostol {
 
             if (ASession->Authorized()) {
 
+                CStringList Params;
+
+                Params.Add(PQQuoteLiteral(Publisher));
+                Params.Add(PQQuoteLiteral(ASession->Session()));
+                Params.Add(PQQuoteLiteral(ASession->Identity()));
+                Params.Add(PQQuoteLiteral(Data));
+                Params.Add(PQQuoteLiteral(ASession->Agent()));
+                Params.Add(PQQuoteLiteral(ASession->IP()));
+
+                try {
+                    auto pData = ExecPrepared(qcObserver, "ws_observer", Params, ASession->Connection(), OnExecuted, OnException);
+                    pData->Values(_T("publisher"), Publisher);
+                    m_Metrics.ObserverQuery(Publisher);
+                } catch (Delphi::Exception::Exception &E) {
+                    DoError(E);
+                }
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::ObserverBatch(const CString &Publisher, const CString &Data, const std::vector<CSession *> &Sessions) {
+
+            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
+
+                const auto& publisher = APollQuery->Data()["publisher"];
+
+                try {
+                    auto pResult = APollQuery->Results(0);
+
+                    if (pResult->ExecStatus() != PGRES_TUPLES_OK) {
+                        throw Delphi::Exception::EDBError(pResult->GetErrorMessage());
+                    }
+
+                    m_Metrics.ObserverRows(publisher, pResult->nTuples());
+
+                    std::unordered_map<std::string, std::vector<CHTTPServerConnection *>> Deliveries;
+
+                    // Rows come back grouped by session and identity: (session, identity, data).
+                    int Row = 0;
+                    while (Row < pResult->nTuples()) {
+                        const CString caSession(pResult->GetValue(Row, 0));
+                        const CString caIdentity(pResult->GetValue(Row, 1));
+
+                        int Last = Row + 1;
+                        while (Last < pResult->nTuples() && caSession == pResult->GetValue(Last, 0) && caIdentity == pResult->GetValue(Last, 1))
+                            Last++;
+
+                        auto pSession = m_SessionIndex.Find(caSession, caIdentity);
+                        auto pConnection = pSession == nullptr ? nullptr : pSession->Connection();
+
+                        if (pConnection != nullptr && !pConnection->ClosedGracefully()) {
+                            CHTTPReply::CStatusType status = CHTTPReply::internal_server_error;
+
+                            try {
+                                if (Last - Row == 1) {
+                                    const CJSON Payload(pResult->GetValue(Row, 2));
+                                    CString errorMessage;
+
+                                    status = ErrorCodeToStatus(CheckError(Payload, errorMessage));
+                                    if (status == CHTTPReply::unauthorized) {
+                                        pSession->Session().Clear();
+                                        pSession->Secret().Clear();
+                                        pSession->Authorization().Clear();
+                                        pSession->Authorized(false);
+                                        m_SessionIndex.Update(pSession);
+                                    }
+
+                                    if (status != CHTTPReply::ok) {
+                                        throw Delphi::Exception::EDBError(errorMessage.c_str());
+                                    }
+
+                                    Deliveries[pResult->GetValue(Row, 2)].push_back(pConnection);
+                                } else {
+                                    CString jsonString;
+
+                                    jsonString = "[";
+                                    for (int i = Row; i < Last; ++i) {
+                                        if (i > Row)
+                                            jsonString << ",";
+                                        jsonString << pResult->GetValue(i, 2);
+                                    }
+                                    jsonString << "]";
+
+                                    DoCall(pConnection, "/" + publisher, jsonString);
+                                }
+                            } catch (Delphi::Exception::Exception &E) {
+                                DoError(pConnection, CString(), CString(), status, E);
+                            }
+                        }
+
+                        Row = Last;
+                    }
+
+                    for (const auto &delivery : Deliveries)
+                        DoBroadcast(delivery.second, "/" + publisher, delivery.first);
+                } catch (Delphi::Exception::Exception &E) {
+                    Log()->Error(APP_LOG_ERR, 0, "[WebSocketAPI] Observer batch (%s): %s", publisher.c_str(), E.what());
+                }
+            };
+
+            auto OnException = [](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                Log()->Error(APP_LOG_ERR, 0, "[WebSocketAPI] Observer batch (%s): %s", APollQuery->Data()["publisher"].c_str(), E.what());
+            };
+
+            size_t Index = 0;
+
+            while (Index < Sessions.size()) {
+                CJSONValue jsonSessions(jvtArray);
+
+                const auto Count = std::min(Sessions.size() - Index, (size_t) m_ObserverBatchSize);
+
+                for (size_t i = Index; i < Index + Count; ++i) {
+                    const auto pSession = Sessions[i];
+
+                    CJSONValue jsonSession(jvtObject);
+
+                    jsonSession.Object().AddPair("session", pSession->Session());
+                    jsonSession.Object().AddPair("identity", pSession->Identity());
+                    jsonSession.Object().AddPair("agent", pSession->Agent());
+                    jsonSession.Object().AddPair("host", pSession->IP());
+
+                    jsonSessions.Array().Add(jsonSession);
+                }
+
+                Index += Count;
+
+                const auto &caSessions = PQQuoteLiteral(jsonSessions.ToString());
+                const auto &caData = PQQuoteLiteral(Data);
+
                 CStringList SQL;
 
-                SQL.Add(CString().Format("SELECT * FROM daemon.observer('%s', '%s', %s, %s::jsonb, %s, %s);",
-                                         Publisher.c_str(),
-                                         ASession->Session().c_str(),
-                                         PQQuoteLiteral(ASession->Identity()).c_str(),
-                                         PQQuoteLiteral(Data).c_str(),
-                                         PQQuoteLiteral(ASession->Agent()).c_str(),
-                                         PQQuoteLiteral(ASession->IP()).c_str()
+                SQL.Add(CString()
+                                .MaxFormatSize(256 + Publisher.Size() + caSessions.Size() + caData.Size())
+                                .Format("SELECT * FROM daemon.observer_batch(%s, %s::jsonb, %s::jsonb);",
+                                        PQQuoteLiteral(Publisher).c_str(),
+                                        caSessions.c_str(),
+                                        caData.c_str()
                 ));
 
                 try {
-                    auto pQuery = ExecSQL(SQL, ASession->Connection(), OnExecuted, OnException);
-                    pQuery->Data().Values(_T("publisher"), Publisher);
+                    auto pData = Schedule(qcObserver, SQL, nullptr, OnExecuted, OnException);
+                    pData->Values(_T("publisher"), Publisher);
+                    m_Metrics.ObserverQuery(Publisher);
                 } catch (Delphi::Exception::Exception &E) {
                     DoError(E);
                 }
@@ -1006,9 +5229,111 @@ namespace Apostol {
         }
         //--------------------------------------------------------------------------------------------------------------
 
+        void CWebSocketAPI::ObserverDiscovery(CSession *ASession) {
+
+            if (ASession == nullptr || !ASession->Authorized() || ASession->Connection() == nullptr)
+                return;
+
+            if (m_ObserverIndex.Known(ASession->Session()) || !m_ObserverIndex.Request(ASession->Session()))
+                return;
+
+            CJSON Payload;
+            CJSONValue jsonFields(jvtArray);
+            CJSONValue jsonFilter(jvtObject);
+
+            jsonFields.Array().Add(CJSONValue(CString(_T("publisher"))));
+            jsonFields.Array().Add(CJSONValue(CString(_T("filter"))));
+            jsonFields.Array().Add(CJSONValue(CString(_T("params"))));
+            jsonFilter.Object().AddPair(_T("session"), ASession->Session());
+
+            Payload.Object().AddPair(_T("fields"), jsonFields);
+            Payload.Object().AddPair(_T("filter"), jsonFilter);
+
+            auto pData = SessionFetch(ASession->Connection(), CString(), _T("/api/v1/observer/listener/list"), Payload.ToString(), ASession);
+            if (pData != nullptr) {
+                pData->Values(_T("Discovery"), _T("true"));
+                pData->Values(_T("Revision"), CString(std::to_string(m_ObserverIndex.Revision(ASession->Session()))));
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::DoObserverDiscovery(CPQPollQuery *APollQuery) {
+
+            auto pConnection = dynamic_cast<CHTTPServerConnection *> (APollQuery->Binding());
+            if (pConnection == nullptr)
+                return;
+
+            auto pSession = m_SessionIndex.FindByConnection(pConnection);
+            if (pSession == nullptr)
+                return;
+
+            try {
+                CString jsonString;
+                PQResultToJson(APollQuery->Results(APollQuery->ResultCount() - 1), jsonString, "array");
+
+                const CJSON Listeners(jsonString);
+
+                CString errorMessage;
+                if (Listeners.Count() == 1 && CheckError(Listeners[0], errorMessage) != 0)
+                    throw Delphi::Exception::EDBError(errorMessage.c_str());
+
+                // A subscription changed while the query ran is not in the snapshot, the snapshot is dropped and loaded again.
+                if (APollQuery->Data()[_T("Revision")] != CString(std::to_string(m_ObserverIndex.Revision(pSession->Session())))) {
+                    m_ObserverIndex.Forget(pSession->Session());
+                    ObserverDiscovery(pSession);
+                    return;
+                }
+
+                m_ObserverIndex.Forget(pSession->Session());
+
+                for (int i = 0; i < Listeners.Count(); ++i) {
+                    const auto& caListener = Listeners[i];
+                    if (caListener.HasOwnProperty(_T("publisher")))
+                        m_ObserverIndex.Subscribe(pSession->Session(), caListener[_T("publisher")].AsString(), caListener);
+                }
+
+                m_ObserverIndex.Discovered(pSession->Session());
+            } catch (Delphi::Exception::Exception &E) {
+                Log()->Error(APP_LOG_WARN, 0, "[WebSocketAPI] Observer discovery failed: %s", E.what());
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::UpdateObserver(CHTTPServerConnection *AConnection, const CString &Action, const CString &Payload) {
+
+            auto pSession = m_SessionIndex.FindByConnection(AConnection);
+            if (pSession == nullptr || Payload.IsEmpty())
+                return;
+
+            const CJSON Request(Payload);
+
+            if (!Request.HasOwnProperty(_T("publisher")))
+                return;
+
+            const auto& publisher = Request[_T("publisher")].AsString();
+            const auto& session = Request.HasOwnProperty(_T("session")) ? Request[_T("session")].AsString() : pSession->Session();
+
+            if (Action == _T("/api/v1/observer/unsubscribe")) {
+                m_ObserverIndex.Unsubscribe(session, publisher);
+            } else if (Action == _T("/api/v1/observer/listener/set") && !(Request.HasOwnProperty(_T("filter")) && Request.HasOwnProperty(_T("params")))) {
+                m_ObserverIndex.Subscribe(session, publisher); // a partial update: keep matching in the database
+            } else {
+                m_ObserverIndex.Subscribe(session, publisher, Request);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
         void CWebSocketAPI::InitListen() {
 
-            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
+            auto OnFailed = [this](const Delphi::Exception::Exception &E) {
+                m_ListenPending = false;
+                m_ListenBackoff = m_ListenBackoff == 0 ? 1 : std::min(m_ListenBackoff * 2, 60);
+                m_ListenRetry = Now() + (CDateTime) m_ListenBackoff / SecsPerDay;
+
+                DoError(E);
+            };
+
+            auto OnExecuted = [this, OnFailed](CPQPollQuery *APollQuery) {
                 try {
                     auto pResult = APollQuery->Results(0);
 
@@ -1016,50 +5341,145 @@ namespace Apostol {
                         throw Delphi::Exception::EDBError(pResult->GetErrorMessage());
                     }
 
-                    APollQuery->Connection()->Listener(true);
+                    m_Listener = APollQuery->Connection();
+                    m_Listener->Listener(true);
 #if defined(_GLIBCXX_RELEASE) && (_GLIBCXX_RELEASE >= 9)
-                    APollQuery->Connection()->OnNotify([this](auto && APollQuery, auto && ANotify) { DoPostgresNotify(APollQuery, ANotify); });
+                    m_Listener->OnNotify([this](auto && APollQuery, auto && ANotify) { DoPostgresNotify(APollQuery, ANotify); });
+                    m_Listener->OnDisconnected([this](auto && AConnection) { DoListenerDisconnected(AConnection); });
 #else
-                    APollQuery->Connection()->OnNotify(std::bind(&CWebSocketAPI::DoPostgresNotify, this, _1, _2));
+                    m_Listener->OnNotify(std::bind(&CWebSocketAPI::DoPostgresNotify, this, _1, _2));
+                    m_Listener->OnDisconnected(std::bind(&CWebSocketAPI::DoListenerDisconnected, this, _1));
 #endif
+                    m_ListenPending = false;
+                    m_ListenBackoff = 0;
+
+                    // Events published while nobody was listening.
+                    if (m_ListenReplay && m_ListenSeen != 0)
+                        ReplayListen(m_ListenSeen);
+
+                    m_ListenSeen = MsEpoch();
                 } catch (Delphi::Exception::Exception &E) {
-                    DoError(E);
+                    OnFailed(E);
                 }
             };
 
-            auto OnException = [](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
-                DoError(E);
+            auto OnException = [OnFailed](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                OnFailed(E);
             };
 
             CStringList SQL;
 
             SQL.Add("SELECT daemon.init_listen();");
 
+            if (!m_RelayChannel.IsEmpty() && !m_NotifyRing.Active())
+                SQL.Add("LISTEN " + m_RelayChannel + ";");
+
+            m_ListenPending = true;
+
             try {
                 ExecSQL(SQL, nullptr, OnExecuted, OnException);
             } catch (Delphi::Exception::Exception &E) {
-                DoError(E);
+                OnFailed(E);
             }
         }
         //--------------------------------------------------------------------------------------------------------------
 
         void CWebSocketAPI::CheckListen() {
-            int Index = 0;
-            while (Index < PQServer().PollManager()->Count() && !PQServer().Connections(Index)->Listener())
-                Index++;
+            // Reconnection after a loss is started by DoListenerDisconnected, the timer only retries a failed attempt.
+            if (m_ListenPending || m_Listener != nullptr || (m_NotifyRing.Active() && !m_NotifyLeader))
+                return;
 
-            if (Index == PQServer().PollManager()->Count())
+            if (Now() >= m_ListenRetry)
                 InitListen();
         }
         //--------------------------------------------------------------------------------------------------------------
 
-        void CWebSocketAPI::Heartbeat() {
-            CApostolModule::Heartbeat();
-            const auto now = Now();
-            if ((now >= m_CheckDate)) {
-                m_CheckDate = now + (CDateTime) 5 / MinsPerDay; // 5 min
+        void CWebSocketAPI::DoListenerDisconnected(CPQConnection *AConnection) {
+            if (AConnection != m_Listener)
+                return;
+
+            m_Listener = nullptr;
+            m_ListenSeen = MsEpoch();
+
+            Log()->Error(APP_LOG_WARN, 0, "[WebSocketAPI] Listener connection lost, reconnecting.");
+
+            CheckListen();
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::ReplayListen(unsigned long long Since) {
+
+            auto OnExecuted = [this](CPQPollQuery *APollQuery) {
+                auto pResult = APollQuery->Results(0);
+
+                if (pResult->ExecStatus() != PGRES_TUPLES_OK) {
+                    DoError(Delphi::Exception::EDBError(pResult->GetErrorMessage()));
+                    return;
+                }
+
+                for (int Row = 0; Row < pResult->nTuples(); ++Row) {
+                    const CString caChannel(pResult->GetValue(Row, 0));
+                    const CString caData(pResult->GetIsNull(Row, 1) ? "" : pResult->GetValue(Row, 1));
+
+                    if (m_NotifyRing.Active() && !m_NotifyRing.Publish(caChannel, caData)) {
+                        Log()->Error(APP_LOG_WARN, 0, "[WebSocketAPI] Replayed event for %s could not be passed to other workers through the notification ring (%d bytes).",
+                                     caChannel.c_str(), (int) caData.Size());
+                    }
+
+                    Notify(caChannel, caData);
+                }
+            };
+
+            auto OnException = [](CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E) {
+                DoError(E);
+            };
+
+            CStringList SQL;
+
+            // A second back: the connection may have gone a little before the loss was noticed.
+            SQL.Add(CString().Format("SELECT channel, payload FROM daemon.listen_replay(to_timestamp(%llu / 1000.0) - interval '1 second');",
+                                     Since));
+
+            try {
+                ExecSQL(SQL, nullptr, OnExecuted, OnException);
+            } catch (Delphi::Exception::Exception &E) {
+                DoError(E);
+            }
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::PollNotify() {
+            if (!m_NotifyRing.Active())
+                return;
+
+            // A worker takes over listening as soon as the previous leader has gone.
+            if (!m_NotifyLeader && m_NotifyRing.Leader()) {
+                m_NotifyLeader = true;
                 CheckListen();
             }
+
+            std::vector<CNotifyRing::CMessage> Messages;
+
+            const auto Missed = m_NotifyRing.Read(Messages);
+            if (Missed != 0)
+                Log()->Error(APP_LOG_WARN, 0, "[WebSocketAPI] Notification ring overrun: %d message(s) lost.", (int) Missed);
+
+            for (const auto &message : Messages)
+                Notify(message.Channel, message.Payload);
+        }
+        //--------------------------------------------------------------------------------------------------------------
+
+        void CWebSocketAPI::Heartbeat() {
+            CApostolModule::Heartbeat();
+
+            RefillBuckets();
+
+            CheckProviders();
+
+            Dispatch();
+            PollNotify();
+
+            CheckListen();
         }
         //--------------------------------------------------------------------------------------------------------------
 
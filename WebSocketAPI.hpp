@@ -25,6 +25,24 @@ Author:
 #define APOSTOL_WEBSOCKETAPI_HPP
 //----------------------------------------------------------------------------------------------------------------------
 
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <zlib.h>
+#include <openssl/core_names.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+//----------------------------------------------------------------------------------------------------------------------
+
 extern "C++" {
 
 namespace Apostol {
@@ -33,6 +51,670 @@ namespace Apostol {
 
         //--------------------------------------------------------------------------------------------------------------
 
+        //-- CObserverFilter -------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        enum CFilterMatch { fmNo = 0, fmMaybe, fmYes };
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CObserverFilter {
+        public:
+
+            static const int FieldCount = 12;
+
+            struct CEvent {
+                uint32_t Fields = 0;
+                std::string Values[FieldCount];
+            };
+
+            static void Parse(const CString &Data, CEvent &Event);
+
+        private:
+
+            bool m_Valid = false;
+
+            uint32_t m_Fields = 0;
+            std::unordered_set<std::string> m_Values[FieldCount];
+
+        public:
+
+            CObserverFilter() = default;
+
+            void Compile(const CJSON &Filter);
+            void Invalidate();
+
+            bool Valid() const { return m_Valid; }
+
+            CFilterMatch Match(const CEvent &Event) const;
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CObserverIndex --------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        enum CObserverMatch { omSkip = 0, omQuery, omDeliver };
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CObserverIndex {
+        private:
+
+            struct CListener {
+                CObserverFilter Filter;
+                bool Notify = false;
+            };
+
+            struct CSessionListeners {
+                bool Known = false;
+                unsigned Revision = 0;
+                std::chrono::steady_clock::time_point Expires;
+                std::chrono::steady_clock::time_point Requested;
+                std::unordered_map<std::string, CListener> Publishers;
+            };
+
+            std::unordered_map<std::string, CSessionListeners> m_Listeners;
+
+            bool m_Prune = false;
+            std::chrono::seconds m_TTL = std::chrono::seconds(60);
+
+        public:
+
+            CObserverIndex() = default;
+
+            void Prune(bool Value, std::chrono::seconds TTL) { m_Prune = Value; m_TTL = TTL; }
+            bool Prune() const { return m_Prune; }
+
+            bool Known(const CString &Session) const;
+            unsigned Revision(const CString &Session) const;
+
+            bool Request(const CString &Session);
+
+            CObserverMatch Match(const CString &Session, const CString &Publisher, const CObserverFilter::CEvent &Event) const;
+
+            void Subscribe(const CString &Session, const CString &Publisher);
+            void Subscribe(const CString &Session, const CString &Publisher, const CJSON &Listener);
+            void Unsubscribe(const CString &Session, const CString &Publisher);
+
+            void Discovered(const CString &Session);
+            void Forget(const CString &Session);
+
+            void Delete(const CString &Session);
+
+            void Clear() { m_Listeners.clear(); }
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CSharedMemory ---------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// Named shared memory block with a process-shared lock, attached by all workers of one master.
+        class CSharedMemory {
+        private:
+
+            struct CHeader;
+
+            CHeader *m_Header = nullptr;
+
+            size_t m_Length = 0;
+            std::string m_Name;
+
+        protected:
+
+            pid_t m_Pid = 0;
+
+            void *Map(const std::string &Name, size_t Length);
+            void Unmap();
+
+            /// Sets up a new segment, called in the worker that created it before the others can use it.
+            virtual void Created(void *AData) {}
+
+            size_t Length() const { return m_Length; }
+
+            void Lock() const;
+            void Unlock() const;
+
+        public:
+
+            CSharedMemory() = default;
+            virtual ~CSharedMemory() { Unmap(); }
+
+            CSharedMemory(const CSharedMemory &) = delete;
+            CSharedMemory &operator=(const CSharedMemory &) = delete;
+
+            bool Active() const { return m_Header != nullptr; }
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CSessionDirectory -----------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// Shared table of connected sessions (session/identity -> worker process).
+        class CSessionDirectory: public CSharedMemory {
+        private:
+
+            struct CHeader;
+            struct CSlot;
+
+            CHeader *m_Header = nullptr;
+            CSlot *m_Slots = nullptr;
+            size_t m_Size = 0;
+            size_t m_Limit = 0;
+
+            size_t Start(const CString &Session) const;
+
+            void Release(CSlot &Slot, size_t Pos) const;
+            void Compact();
+
+        protected:
+
+            void Created(void *AData) override;
+
+        public:
+
+            CSessionDirectory() = default;
+            ~CSessionDirectory() override { Close(); }
+
+            bool Open(size_t Size);
+            void Close();
+
+            void Add(const CString &Session, const CString &Identity);
+            void Remove(const CString &Session, const CString &Identity);
+
+            void Find(const CString &Session, const CString &Identity, std::vector<pid_t> &Workers) const;
+
+            CString Sign(const CString &Data) const;
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CNotifyRing -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// Shared ring of NOTIFY messages: one worker listens to PostgreSQL and publishes, the others read by sequence.
+        class CNotifyRing: public CSharedMemory {
+        private:
+
+            struct CHeader;
+            struct CSlot;
+
+            CHeader *m_Header = nullptr;
+            CSlot *m_Slots = nullptr;
+            size_t m_Size = 0;
+
+            uint64_t m_Sequence = 0;
+
+            int m_Wakeup = -1;
+
+            static std::string WakeupName(pid_t Pid);
+
+            void Wake(pid_t Target) const;
+
+        public:
+
+            struct CMessage {
+                CString Channel;
+                CString Payload;
+            };
+
+            CNotifyRing() = default;
+            ~CNotifyRing() override { Close(); }
+
+            bool Open(size_t Size);
+            void Close();
+
+            bool Leader();
+
+            bool Publish(const CString &Channel, const CString &Payload, pid_t Target = 0);
+            uint64_t Read(std::vector<CMessage> &Messages);
+
+            /// Datagram socket that becomes readable when another worker publishes a message for this one.
+            int Handle() const { return m_Wakeup; }
+            void Drain() const;
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CSessionIndex ---------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CSessionIndex {
+        private:
+
+            struct CEntry {
+                std::string Session;
+                std::string Identity;
+                CHTTPServerConnection *Connection = nullptr;
+            };
+
+            std::unordered_map<const CSession *, CEntry> m_Entries;
+
+            std::unordered_map<std::string, std::vector<CSession *>> m_Sessions;
+            std::unordered_map<std::string, CSession *> m_Identities;
+            std::unordered_map<const CHTTPServerConnection *, CSession *> m_Connections;
+
+            static std::string IdentityKey(const std::string &Session, const std::string &Identity) {
+                return Session + '/' + Identity;
+            }
+
+            CSessionDirectory *m_Directory = nullptr;
+
+            void Remove(const CSession *ASession, const CEntry &Entry);
+
+        public:
+
+            CSessionIndex() = default;
+
+            void Directory(CSessionDirectory *Value) { m_Directory = Value; }
+
+            void Add(CSession *ASession);
+            void Update(CSession *ASession);
+            void Delete(CSession *ASession);
+
+            void Disconnect(CHTTPServerConnection *AConnection);
+
+            CSession *Find(const CString &Session, const CString &Identity) const;
+            CSession *FindByConnection(CHTTPServerConnection *AConnection) const;
+
+            const std::vector<CSession *> &List(const CString &Session) const;
+
+            void Clear();
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- COutboundQueue --------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class COutboundQueue {
+        private:
+
+            struct CMessage {
+                CString Payload;
+                bool Droppable;
+            };
+
+            std::deque<CMessage> m_Messages;
+
+            size_t m_Size = 0;
+            bool m_Paused = false;
+
+        public:
+
+            COutboundQueue() = default;
+
+            bool Empty() const { return m_Messages.empty(); }
+            size_t Size() const { return m_Size; }
+
+            bool Paused() const { return m_Paused; }
+            void Paused(bool Value) { m_Paused = Value; }
+
+            void Push(const CString &Payload, bool Droppable);
+            bool DropOldest();
+
+            const CString &Front() const { return m_Messages.front().Payload; }
+            void Pop();
+
+            void Clear();
+
+            size_t Count() const { return m_Messages.size(); }
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CTooManyRequests: public Delphi::Exception::Exception {
+        public:
+
+            explicit CTooManyRequests(LPCTSTR Message): Delphi::Exception::Exception(Message) {};
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CTokenVerifiers;
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CTokenCache -----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CTokenCache {
+        public:
+
+            typedef std::chrono::system_clock::time_point CTimePoint;
+
+        private:
+
+            struct CEntry {
+                std::string Token;
+                CString Subject;
+                CTimePoint Expires;
+            };
+
+            size_t m_Capacity = 4096;
+
+            std::list<CEntry> m_Entries;
+            std::unordered_map<std::string, std::list<CEntry>::iterator> m_Index;
+
+        public:
+
+            CTokenCache() = default;
+
+            size_t Capacity() const { return m_Capacity; }
+            void Capacity(size_t Value);
+
+            size_t Count() const { return m_Entries.size(); }
+
+            bool Find(const CString &Token, CString &Subject);
+            void Add(const CString &Token, const CString &Subject, CTimePoint Expires);
+
+            void Clear();
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CResponseCache --------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CResponseCache {
+        public:
+
+            typedef std::chrono::steady_clock::time_point CTimePoint;
+
+        private:
+
+            struct CEntry {
+                std::string Key;
+                CString Action;
+                CString Payload;
+                CTimePoint Expires;
+            };
+
+            size_t m_Limit = 16 * 1024 * 1024;
+            size_t m_Size = 0;
+
+            std::list<CEntry> m_Entries;
+            std::unordered_map<std::string, std::list<CEntry>::iterator> m_Index;
+
+            void Delete(std::list<CEntry>::iterator Entry);
+
+            static bool HasSegment(const CString &Path, const CString &Segment);
+
+        public:
+
+            CResponseCache() = default;
+
+            size_t Limit() const { return m_Limit; }
+            void Limit(size_t Value);
+
+            size_t Size() const { return m_Size; }
+            size_t Count() const { return m_Entries.size(); }
+
+            bool Find(const CString &Key, CString &Payload);
+            void Add(const CString &Key, const CString &Action, const CString &Payload, CTimePoint Expires);
+
+            size_t Invalidate(const CString &Segment);
+            void Clear();
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CDeflatePool ----------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CDeflatePool {
+        private:
+
+            int m_Level;
+            int m_WindowBits;
+            int m_MemLevel;
+
+            size_t m_Capacity;
+
+            std::vector<z_stream *> m_Streams;
+
+        public:
+
+            CDeflatePool();
+
+            ~CDeflatePool();
+
+            void Init(int Level, int WindowBits, int MemLevel, size_t Capacity);
+
+            z_stream *Acquire();
+            void Release(z_stream *AStream);
+
+            void Clear();
+
+            static bool Deflate(z_stream *AStream, const CString &Data, CString &Result);
+            static bool Inflate(z_stream *AStream, const CString &Data, CString &Result, size_t Limit);
+
+            static z_stream *NewInflate();
+            static void FreeInflate(z_stream *AStream);
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CMsgPack --------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        class CMsgPack {
+        private:
+
+            static void WriteInteger(std::string &Buffer, int64_t Value);
+            static void WriteString(std::string &Buffer, const char *Data, size_t Size);
+
+            static bool ReadInteger(const unsigned char *&Data, const unsigned char *End, int64_t &Value);
+            static bool ReadString(const unsigned char *&Data, const unsigned char *End, CString &Value);
+
+            static bool ScanValue(const char *&Data, const char *End);
+            static bool ScanString(const char *&Data, const char *End, std::string &Value);
+            static bool ScanLiteral(const char *&Data, const char *End);
+
+        public:
+
+            /// Converts a JSON envelope into a MessagePack map, "p" is copied as raw JSON text without being parsed.
+            static bool Encode(const CString &Json, CString &Result);
+
+            /// Reads a MessagePack envelope, "p" is returned as raw JSON text in Payload.
+            static bool Decode(const CString &Data, CWSMessage &Message, CString &Payload);
+
+            /// Reads a JSON envelope without building a tree, "p" is returned as raw JSON text in Payload.
+            static bool Split(const CString &Json, CWSMessage &Message, CString &Payload);
+
+            /// Checks JSON syntax in one pass without building a tree.
+            static bool Valid(const CString &Json);
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CMetrics --------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// Latency histogram with fixed logarithmic buckets (in seconds).
+        class CHistogram {
+        public:
+
+            static constexpr size_t BucketCount = 16;
+
+        private:
+
+            uint64_t m_Buckets[BucketCount + 1] = {};
+            uint64_t m_Count = 0;
+            double m_Sum = 0;
+
+        public:
+
+            void Observe(double Seconds);
+
+            void Write(std::string &Output, const char *Name, const std::string &Labels) const;
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        /// Per-worker counters for /ws/metrics. Workers are single threaded, so plain integers are enough.
+        class CMetrics {
+        public:
+
+            struct CObserver {
+                uint64_t Queries = 0;
+                uint64_t Rows = 0;
+            };
+
+        private:
+
+            static constexpr size_t MaxActions = 256;
+
+            std::unordered_map<std::string, CHistogram> m_Calls;
+            std::unordered_map<std::string, CHistogram> m_Queries;
+            std::unordered_map<std::string, uint64_t> m_Notifications;
+            std::unordered_map<std::string, CObserver> m_Observers;
+
+            uint64_t m_MessagesIn = 0;
+            uint64_t m_MessagesOut = 0;
+            uint64_t m_BytesIn = 0;
+            uint64_t m_BytesOut = 0;
+
+        public:
+
+            static void Label(std::string &Output, const char *Name, const std::string &Value);
+
+            void Call(const CString &Action, double Seconds);
+            void Query(const CString &Statement, double Seconds);
+
+            void Notification(const CString &Publisher) { m_Notifications[Publisher.c_str()]++; }
+
+            void ObserverQuery(const CString &Publisher) { m_Observers[Publisher.c_str()].Queries++; }
+            void ObserverRows(const CString &Publisher, int Rows) { m_Observers[Publisher.c_str()].Rows += Rows; }
+
+            void Received(size_t Bytes) { m_MessagesIn++; m_BytesIn += Bytes; }
+            void Sent(size_t Bytes) { m_MessagesOut++; m_BytesOut += Bytes; }
+
+            void Write(std::string &Output) const;
+
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        //-- CWSContext ------------------------------------------------------------------------------------------------
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CWSFetch {
+            CString UniqueId;
+            CString Action;
+            CString Payload;
+            CString Key;
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CWSStream {
+            PGresult *Result = nullptr;
+            std::string Header;
+            int Row = 0;
+            int Part = 0;
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CWSBatch {
+            int Attempt = 0;
+            CStringList Prepared;
+            CStringList SQL;
+            std::vector<int> Results;
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CWSWaiter {
+            CHTTPServerConnection *Connection;
+            CString UniqueId;
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CWSBucket {
+            double Tokens = -1;
+            std::chrono::steady_clock::time_point Refill;
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CWSCall {
+            CHTTPServerConnection *Connection;
+            CWSFetch Fetch;
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        enum CQueryClass { qcInteractive = 0, qcAuth, qcObserver, qcCount };
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CWSJob {
+            CStringList SQL;
+            CStringList Data;
+            CPollConnection *Binding;
+            COnApostolModuleSuccessEvent OnExecuted;
+            COnApostolModuleFailEvent OnException;
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CWSInFlight {
+            std::vector<CWSWaiter> Waiters;
+            size_t Generation = 0;
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
+        struct CWSContext {
+            bool Deflate = false;
+            bool MsgPack = false;
+
+            bool Busy = false;
+            std::deque<CWSFetch> Pending;
+            size_t Isolated = 0;
+
+            EVP_MAC_CTX *Hmac = nullptr;
+            CString HmacKey;
+
+            size_t Chunk = 0;
+            std::deque<CWSStream> Streams;
+
+            std::unordered_map<std::string, std::chrono::steady_clock::time_point> Calls;
+
+            z_stream *Deflater = nullptr;
+            z_stream *Inflater = nullptr;
+        };
+
+        //--------------------------------------------------------------------------------------------------------------
+
         //-- CWebSocketAPI -----------------------------------------------------------------------------------------------
 
         //--------------------------------------------------------------------------------------------------------------
@@ -40,20 +722,176 @@ namespace Apostol {
         class CWebSocketAPI: public CApostolModule {
         private:
 
-            CDateTime m_CheckDate;
+            bool m_ListenPending;
+            bool m_ListenReplay;
+            int m_ListenBackoff;
+            CDateTime m_ListenRetry;
+            unsigned long long m_ListenSeen;
+            CPQConnection *m_Listener;
+
+            bool m_ObserverBatch;
+            int m_ObserverBatchSize;
+            bool m_ObserverLocal;
+
+            bool m_BroadcastSharedId;
+
+            size_t m_OutboundHighWatermark;
+            size_t m_OutboundLowWatermark;
+            size_t m_OutboundLimit;
+            bool m_OutboundCloseSlow;
+
+            bool m_MsgPack;
+
+            bool m_PreparedStatements;
+            bool m_TrustedSecret;
+
+            bool m_Pipeline;
+            size_t m_PipelineDepth;
+
+            CWSBatch *m_Collector;
+
+            double m_RateLimit;
+            double m_RateBurst;
+            std::unordered_map<std::string, CWSBucket> m_RateBuckets;
+
+            size_t m_MaxInFlight;
+            size_t m_AdmissionLimit;
+
+            size_t m_StreamChunk;
+            size_t m_InFlightCalls;
+
+            std::deque<CWSCall> m_Admission;
+
+            size_t m_SchedulerSlots;
+            size_t m_Reserve[qcCount];
+            int m_Weight[qcCount];
+            int m_Credit[qcCount];
+            size_t m_Running[qcCount];
+
+            std::deque<CWSJob> m_Jobs[qcCount];
+
+            CStringList m_ReadOnlyActions;
+            std::unordered_map<std::string, CWSInFlight> m_InFlight;
+
+            CStringList m_CacheActions;
+            CStringList m_CacheInvalidate;
+            CResponseCache m_ResponseCache;
+            std::chrono::seconds m_CacheTTL;
+            size_t m_CacheGeneration;
+
+            CTokenCache m_TokenCache;
+            std::chrono::seconds m_TokenCacheTTL;
+
+            std::shared_ptr<CTokenVerifiers> m_TokenVerifiers;
+
+            bool m_Deflate;
+            size_t m_DeflateThreshold;
+            bool m_DeflateContextTakeover;
+
+            size_t m_MaxMessageSize;
+
+            CDeflatePool m_DeflatePool;
 
             CSessionManager m_SessionManager;
+            CSessionIndex m_SessionIndex;
+
+            CSessionDirectory m_SessionDirectory;
+            CString m_RelayChannel;
+
+            CNotifyRing m_NotifyRing;
+            bool m_NotifyLeader;
+
+            CPollEventHandler *m_NotifyHandler;
+
+            CMetrics m_Metrics;
+
+            std::unordered_map<CHTTPServerConnection *, COutboundQueue> m_Outbound;
+            std::unordered_map<CHTTPServerConnection *, CWSContext> m_Contexts;
+
+            CObserverIndex m_ObserverIndex;
 
             void InitListen();
             void CheckListen();
+            void DoListenerDisconnected(CPQConnection *AConnection);
+            void ReplayListen(unsigned long long Since);
+            void PollNotify();
+
+            void Notify(const CString &Publisher, const CString &Data);
 
             void Observer(CSession *ASession, const CString &Publisher, const CString &Data);
+            void ObserverBatch(const CString &Publisher, const CString &Data, const std::vector<CSession *> &Sessions);
+
+            void ObserverDiscovery(CSession *ASession);
+            void UpdateObserver(CHTTPServerConnection *AConnection, const CString &Action, const CString &Payload);
+
+            static bool IsObserverAction(const CString &Action);
 
             void InitMethods() override;
 
             static void AfterQuery(CHTTPServerConnection *AConnection, const CString &Path, const CJSON &Payload);
 
-            static void QueryException(CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E);
+            void QueryException(CPQPollQuery *APollQuery, const Delphi::Exception::Exception &E);
+
+            void FetchResult(CHTTPServerConnection *AConnection, CPQResult *AResult, const CString &UniqueId,
+                const CString &Action, const CString &Payload, const CString &Key = CString());
+
+            bool StreamResult(CHTTPServerConnection *AConnection, CPQResult *AResult, const CString &UniqueId,
+                const CString &Action);
+            void WriteStream(CHTTPServerConnection *AConnection);
+
+            static void QuoteJson(std::string &Buffer, const CString &Value);
+            static CString CallResult(const CString &UniqueId, const CString &Action, const CString &Payload);
+
+            void ReadList(const CString &Key, CStringList &List);
+            size_t ReadSize(const CString &Key, int Default, int Min = 0);
+
+            static bool MatchAction(const CStringList &Patterns, const CString &Action);
+            static CString CanonicalPayload(const CString &Payload);
+
+            void InvalidateCache(const CString &Publisher, const CObserverFilter::CEvent &Event);
+
+            bool RateLimited(CHTTPServerConnection *AConnection, CSession *ASession);
+            void RefillBuckets();
+
+            void AdmitCall(CHTTPServerConnection *AConnection, const CString &UniqueId, const CString &Action,
+                const CString &Payload, CSession *ASession);
+            void CallFinished();
+
+            void CoalescedFetch(CHTTPServerConnection *AConnection, const CString &UniqueId, const CString &Action,
+                const CString &Payload, CSession *ASession);
+            void CoalesceReply(const CString &Key, const CWSMessage &Response, const CString &Payload = CString());
+            void CoalesceError(const CString &Key, const CString &Action, int ErrorCode, const CString &Message);
+            void CoalesceHandOff(const CWSFetch &Fetch);
+
+            void PipelineFetch(CHTTPServerConnection *AConnection, const CString &UniqueId, const CString &Action,
+                const CString &Payload, CSession *ASession, const CString &Key = CString());
+            void PipelineNext(CHTTPServerConnection *AConnection);
+            void PipelineBatch(CHTTPServerConnection *AConnection, CSession *ASession, CQueryClass Class,
+                const std::vector<CWSFetch> &Batch, int Attempt);
+
+            void WriteMessage(CHTTPServerConnection *AConnection, const CString &Message, bool Droppable = false);
+            void FlushOutbound(CHTTPServerConnection *AConnection);
+
+            void WriteFrame(CHTTPServerConnection *AConnection, const CString &Message, bool SendNow);
+            bool WriteShared(CHTTPServerConnection *AConnection, const CString &Frame, size_t Pos, const CString &UniqueId);
+            bool DeflateFrame(CHTTPServerConnection *AConnection, CWSContext &Context, const CString &Message, CString &Frame);
+            bool InflateRequest(CHTTPServerConnection *AConnection, const CString &Request, CString &Result);
+            void InflateFailed(CHTTPServerConnection *AConnection);
+
+            bool IsDeflate(CHTTPServerConnection *AConnection) const;
+            bool IsMsgPack(CHTTPServerConnection *AConnection) const;
+
+            CString SessionSignature(CHTTPServerConnection *AConnection, const CString &Secret, const CString &Data);
+            void DeleteContext(CHTTPServerConnection *AConnection);
+
+            static size_t PendingBytes(CHTTPServerConnection *AConnection);
+
+            CString ProvidersFingerprint();
+            void CheckProviders();
+
+            static CString StatementSQL(const CString &Statement, const CStringList &Params, int Attempt);
+
+            static void EncodeFrame(unsigned char Opcode, const CString &Payload, CString &Frame);
 
             static bool CheckAuthorizationData(CHTTPRequest *ARequest, CAuthorization &Authorization);
 
@@ -64,16 +902,29 @@ namespace Apostol {
 
             static void DoError(const Delphi::Exception::Exception &E);
 
-            static void DoCall(CHTTPServerConnection *AConnection, const CString &Action, const CString &Payload);
-            static void DoError(CHTTPServerConnection *AConnection, const CString &UniqueId, const CString &Action,
+            void DoCall(CHTTPServerConnection *AConnection, const CString &Action, const CString &Payload);
+            void DoBroadcast(const std::vector<CHTTPServerConnection *> &Connections, const CString &Action, const CString &Payload);
+            void DoError(CHTTPServerConnection *AConnection, const CString &UniqueId, const CString &Action,
                 CHTTPReply::CStatusType Status, const std::exception &e);
 
             void DoGet(CHTTPServerConnection *AConnection) override;
             void DoPost(CHTTPServerConnection *AConnection);
+
+            void CallStarted(CHTTPServerConnection *AConnection, const CString &UniqueId);
+            void CallReplied(CHTTPServerConnection *AConnection, const CString &UniqueId, const CString &Action);
+
+            void DoMetrics(CHTTPServerConnection *AConnection);
+
+            bool Deliver(const CString &Session, const CString &Identity, const CString &Payload);
+            bool Relay(const std::vector<pid_t> &Workers, const CString &Session, const CString &Identity, const CString &Payload);
+            void DoRelay(const CString &Data);
             void DoWS(CHTTPServerConnection *AConnection, const CString &Action);
 
             void DoWebSocket(CHTTPServerConnection *AConnection);
             void DoSessionDisconnected(CObject *Sender);
+            void DoConnectionWorkEnd(CObject *Sender, CWorkMode AWorkMode);
+
+            void DoObserverDiscovery(CPQPollQuery *APollQuery);
 
             void DoPostgresNotify(CPQConnection *AConnection, PGnotify *ANotify) override;
 
@@ -95,16 +946,34 @@ namespace Apostol {
 
             CString VerifyToken(const CString &Token);
 
-            void UnauthorizedFetch(CHTTPServerConnection *AConnection, const CString &UniqueId, const CString &Action,
+            CStringList *Schedule(CQueryClass Class, const CStringList &SQL, CPollConnection *ABinding,
+                COnApostolModuleSuccessEvent OnExecuted, COnApostolModuleFailEvent OnException);
+
+            bool CanLaunch(CQueryClass Class) const;
+            CStringList *Launch(CQueryClass Class, CWSJob &Job);
+            void Dispatch();
+
+            CStringList *ExecPrepared(CQueryClass Class, const CString &Statement, const CStringList &Params, CPollConnection *AConnection,
+                COnApostolModuleSuccessEvent OnExecuted, COnApostolModuleFailEvent OnException, int Attempt = 0);
+
+            static CQueryClass CallClass(const CString &Action);
+
+            CStringList *ExecFetch(CHTTPServerConnection *AConnection, const CString &Statement, const CStringList &Params,
+                const CString &UniqueId, const CString &Action, const CString &Payload);
+
+            CStringList *UnauthorizedFetch(CHTTPServerConnection *AConnection, const CString &UniqueId, const CString &Action,
                 const CString &Payload, const CString &Agent, const CString &Host);
 
-            void AuthorizedFetch(CHTTPServerConnection *AConnection, const CAuthorization &Authorization, const CString &UniqueId,
+            CStringList *AuthorizedFetch(CHTTPServerConnection *AConnection, const CAuthorization &Authorization, const CString &UniqueId,
                 const CString &Action, const CString &Payload, const CString &Agent, const CString &Host);
 
-            void PreSignedFetch(CHTTPServerConnection *AConnection, const CString &UniqueId, const CString &Action,
+            CStringList *PreSignedFetch(CHTTPServerConnection *AConnection, const CString &UniqueId, const CString &Action,
+                const CString &Payload, CSession *ASession);
+
+            CStringList *SessionFetch(CHTTPServerConnection *AConnection, const CString &UniqueId, const CString &Action,
                 const CString &Payload, CSession *ASession);
 
-            void SignedFetch(CHTTPServerConnection *AConnection, const CString &UniqueId, const CString &Action,
+            CStringList *SignedFetch(CHTTPServerConnection *AConnection, const CString &UniqueId, const CString &Action,
                 const CString &Payload, const CString &Session, const CString &Nonce, const CString &Signature,
                 const CString &Agent, const CString &Host, long int ReceiveWindow = 5000);
 